@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "extent_tree.h"
+
+// Compares the two ways of finding free space on a block space much larger
+// than the on-disk one (which has only NUM_BLOCKS blocks): scanning a bitmap
+// for a run of free blocks, as basic_file_system.c does, and the free extent
+// tree.  Both run the same random mix of allocations (of 1 to max_run blocks)
+// and frees, on a space that is first filled and then fragmented.
+
+// one allocation that is still live
+struct run {
+  uint32_t start;
+  uint32_t length;
+};
+
+struct allocator {
+  const char* name;
+  void (*init)(uint32_t num_blocks);
+  int (*alloc)(uint32_t length, uint32_t* start); // 0 on success
+  void (*release)(uint32_t start, uint32_t length);
+  void (*destroy)();
+};
+
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// the bitmap, searched first-fit from the end of the last allocation
+static unsigned char* bitmap;
+static uint32_t bitmap_blocks;
+static uint32_t bitmap_goal;
+
+static void bitmap_init(uint32_t num_blocks) {
+  bitmap_blocks = num_blocks;
+  bitmap = calloc((num_blocks + 7) / 8, 1);
+  bitmap_goal = 0;
+}
+
+// finds the first run of length free blocks within [from, to), skipping
+// bytes that are all allocated
+static int64_t bitmap_find_run(uint32_t length, uint32_t from, uint32_t to) {
+  uint32_t run = 0;
+  for (uint32_t block = from; block < to; block++) {
+    if (block % 8 == 0 && bitmap[block / 8] == 0xff) {
+      run = 0;
+      block += 7;
+    } else if (bitmap[block / 8] & (1 << (block % 8))) {
+      run = 0;
+    } else if (++run == length) {
+      return block - length + 1;
+    }
+  }
+  return -1;
+}
+
+static int bitmap_alloc(uint32_t length, uint32_t* start) {
+  int64_t found = bitmap_find_run(length, bitmap_goal, bitmap_blocks);
+  if (found < 0) {
+    uint32_t to = bitmap_goal + length - 1;
+    found = bitmap_find_run(length, 0, to < bitmap_blocks ? to : bitmap_blocks);
+  }
+  if (found < 0) {
+    return -1;
+  }
+  for (uint32_t block = found; block < found + length; block++) {
+    bitmap[block / 8] |= 1 << (block % 8);
+  }
+  *start = found;
+  bitmap_goal = found + length < bitmap_blocks ? found + length : 0;
+  return 0;
+}
+
+static void bitmap_release(uint32_t start, uint32_t length) {
+  for (uint32_t block = start; block < start + length; block++) {
+    bitmap[block / 8] &= ~(1 << (block % 8));
+  }
+}
+
+static void bitmap_destroy() {
+  free(bitmap);
+}
+
+
+// the free extent tree, best fit
+static struct extent_tree tree;
+
+static void tree_init(uint32_t num_blocks) {
+  if (extent_tree_init(&tree, (num_blocks + 1) / 2 + 1) < 0) {
+    perror("extent_tree_init");
+    exit(1);
+  }
+  extent_tree_add(&tree, 0, num_blocks);
+}
+
+static int tree_alloc(uint32_t length, uint32_t* start) {
+  return extent_tree_alloc(&tree, length, start);
+}
+
+static void tree_release(uint32_t start, uint32_t length) {
+  extent_tree_add(&tree, start, length);
+}
+
+static void tree_destroy() {
+  extent_tree_destroy(&tree);
+}
+
+
+static const struct allocator allocators[] = {
+  { "bitmap", bitmap_init, bitmap_alloc, bitmap_release, bitmap_destroy },
+  { "extents", tree_init, tree_alloc, tree_release, tree_destroy },
+};
+
+
+// xorshift64, so that both allocators see the same sequence of requests
+static uint64_t rng_state;
+
+static uint32_t next_random(uint32_t bound) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state % bound;
+}
+
+// run lengths are skewed towards small ones, like files on a real disk
+static uint32_t random_length(uint32_t max_run) {
+  uint32_t length = 1 + next_random(max_run);
+  return next_random(4) == 0 ? length : 1 + length / 8;
+}
+
+
+/* run_benchmark
+ *   fills the space to about 90%, frees every other allocation to fragment
+ *   it, then times num_ops random allocations and frees, and prints the
+ *   results for one allocator
+ */
+static void run_benchmark(const struct allocator* allocator, uint32_t num_blocks,
+                          uint32_t num_ops, uint32_t max_run, uint64_t seed) {
+  struct run* live = malloc(num_blocks * sizeof(struct run));
+  uint32_t num_live = 0;
+  uint64_t used = 0;
+  rng_state = seed;
+  allocator->init(num_blocks);
+
+  // fill, then fragment
+  uint64_t setup_start = now_ns();
+  while (used < (uint64_t) num_blocks * 9 / 10) {
+    struct run run = { 0, random_length(max_run) };
+    if (allocator->alloc(run.length, &run.start) < 0) {
+      break;
+    }
+    live[num_live++] = run;
+    used += run.length;
+  }
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < num_live; i++) {
+    if (i % 2 == 0) {
+      allocator->release(live[i].start, live[i].length);
+      used -= live[i].length;
+    } else {
+      live[kept++] = live[i];
+    }
+  }
+  num_live = kept;
+  uint64_t setup_ns = now_ns() - setup_start;
+
+  // the timed mix: allocations and frees, keeping usage around 50-90%
+  uint64_t failed = 0;
+  uint64_t alloc_ns = 0, release_ns = 0, num_allocs = 0, num_releases = 0;
+  for (uint32_t op = 0; op < num_ops; op++) {
+    int do_alloc = num_live == 0 || (used < (uint64_t) num_blocks * 9 / 10 && next_random(2) == 0);
+    if (do_alloc) {
+      struct run run = { 0, random_length(max_run) };
+      uint64_t start = now_ns();
+      int ret = allocator->alloc(run.length, &run.start);
+      alloc_ns += now_ns() - start;
+      num_allocs++;
+      if (ret < 0) {
+        failed++;
+      } else {
+        live[num_live++] = run;
+        used += run.length;
+      }
+    } else {
+      uint32_t i = next_random(num_live);
+      uint64_t start = now_ns();
+      allocator->release(live[i].start, live[i].length);
+      release_ns += now_ns() - start;
+      num_releases++;
+      used -= live[i].length;
+      live[i] = live[--num_live];
+    }
+  }
+
+  printf("%-8s %10.3f %12.0f %12.0f %10lu %10lu\n", allocator->name, setup_ns / 1e9,
+         num_allocs ? (double) alloc_ns / num_allocs : 0.0,
+         num_releases ? (double) release_ns / num_releases : 0.0,
+         (unsigned long) failed, (unsigned long) used);
+  allocator->destroy();
+  free(live);
+}
+
+
+int main(int argc, char* argv[]) {
+  uint32_t num_blocks = 1 << 20;
+  uint32_t num_ops = 200000;
+  uint32_t max_run = 64;
+  uint64_t seed = 88172645463325252ull;
+  int opt;
+  int bad_option = 0;
+  while ((opt = getopt(argc, argv, "n:o:r:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      num_blocks = strtoul(optarg, NULL, 10);
+      break;
+    case 'o':
+      num_ops = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      max_run = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 10) | 1; // (xorshift needs a nonzero state)
+      break;
+    default:
+      bad_option = 1; // print the usage below
+    }
+  }
+  if (bad_option || optind != argc || num_blocks < 2 || max_run < 1 || max_run > num_blocks) {
+    fprintf(stderr, "usage: %s [-n num_blocks] [-o num_ops] [-r max_run] [-s seed]\n"
+                    "  -n  size of the block space (default 1048576)\n"
+                    "  -o  number of timed allocations and frees (default 200000)\n"
+                    "  -r  longest run of blocks to allocate at once (default 64)\n"
+                    "  -s  random seed\n", argv[0]);
+    return 1;
+  }
+
+  printf("%u blocks, %u ops, runs of 1 to %u blocks\n", num_blocks, num_ops, max_run);
+  printf("%-8s %10s %12s %12s %10s %10s\n",
+         "", "setup s", "alloc ns", "free ns", "failed", "used");
+  for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+    run_benchmark(&allocators[i], num_blocks, num_ops, max_run, seed);
+  }
+  return 0;
+}
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "raw_disk.h"
+
+#define DISK_FILENAME "DISK"
+
+// An incremental backup file is a header, then one record per changed block,
+// then (if has_aux is set) the whole aux area
+#define INCREMENTAL_MAGIC "JFSI"
+#define INCREMENTAL_VERSION 1
+
+struct incremental_header {
+  char magic[4];       // INCREMENTAL_MAGIC
+  uint32_t version;    // INCREMENTAL_VERSION
+  uint32_t since;      // checkpoint the changes are relative to (0 for a full backup)
+  uint32_t until;      // checkpoint taken when the changes were exported
+  uint32_t num_blocks; // block records that follow
+  uint32_t has_aux;    // 1 if the aux area follows the block records
+};
+
+struct block_record {
+  block_num_t block_num;
+  char data[BLOCK_SIZE];
+};
+
+
+/* export_incremental
+ *   writes the blocks (and aux area) changed since a checkpoint to out_path,
+ *   and starts a new checkpoint for the next incremental backup
+ * returns 0 on success or 1 on failure
+ */
+static int export_incremental(uint32_t since, const char* out_path) {
+  FILE* out = fopen(out_path, "wb");
+  if (out == NULL) {
+    perror(out_path);
+    return 1;
+  }
+  struct incremental_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INCREMENTAL_MAGIC, sizeof(header.magic));
+  header.version = INCREMENTAL_VERSION;
+  header.since = since;
+  header.until = raw_checkpoint();
+  if (header.until == 0) {
+    fprintf(stderr, "failed to take a checkpoint\n");
+    fclose(out);
+    return 1;
+  }
+  block_num_t blocks[NUM_BLOCKS];
+  int aux_changed;
+  header.num_blocks = raw_changed_blocks(since, blocks, &aux_changed);
+  header.has_aux = aux_changed;
+  int ret = fwrite(&header, sizeof(header), 1, out) == 1 ? 0 : 1;
+
+  raw_prefetch(blocks, header.num_blocks);
+  for (uint32_t i = 0; i < header.num_blocks && ret == 0; i++) {
+    struct block_record record;
+    record.block_num = blocks[i];
+    if (read_block(blocks[i], record.data) < 0) {
+      fprintf(stderr, "failed to read block %d\n", blocks[i]);
+      ret = 1;
+    } else if (fwrite(&record, sizeof(record), 1, out) != 1) {
+      ret = 1;
+    }
+  }
+  if (ret == 0 && header.has_aux) {
+    char aux[RAW_AUX_SIZE];
+    if (raw_read_aux(0, aux, sizeof(aux)) < 0 || fwrite(aux, sizeof(aux), 1, out) != 1) {
+      ret = 1;
+    }
+  }
+  if (fclose(out) != 0 || ret != 0) {
+    fprintf(stderr, "failed to write %s\n", out_path);
+    return 1;
+  }
+  printf("%u blocks%s changed since checkpoint %u\n", header.num_blocks,
+         header.has_aux ? " and the aux area" : "", since);
+  printf("Checkpoint %u\n", header.until);
+  return 0;
+}
+
+
+/* apply_incremental
+ *   writes the blocks (and aux area) of an incremental backup to the image;
+ *   backups must be applied in order, starting from a full one: the image
+ *   records the checkpoint each one brings it up to, and an incremental
+ *   backup whose since checkpoint isn't that one is refused
+ * returns 0 on success or 1 on failure
+ */
+static int apply_incremental(const char* in_path) {
+  FILE* in = fopen(in_path, "rb");
+  if (in == NULL) {
+    perror(in_path);
+    return 1;
+  }
+  struct incremental_header header;
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, INCREMENTAL_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != INCREMENTAL_VERSION || header.num_blocks > NUM_BLOCKS) {
+    fprintf(stderr, "%s is not an incremental backup\n", in_path);
+    fclose(in);
+    return 1;
+  }
+  uint32_t applied = raw_applied_checkpoint();
+  if (header.since != 0 && header.since != applied) {
+    if (applied == 0) {
+      fprintf(stderr, "%s holds the changes since checkpoint %u, but no backup has been "
+                      "applied to the image yet; apply a full backup first\n", in_path, header.since);
+    } else {
+      fprintf(stderr, "%s holds the changes since checkpoint %u, but the image is at "
+                      "checkpoint %u\n", in_path, header.since, applied);
+    }
+    fclose(in);
+    return 1;
+  }
+  int ret = 0;
+  for (uint32_t i = 0; i < header.num_blocks && ret == 0; i++) {
+    struct block_record record;
+    if (fread(&record, sizeof(record), 1, in) != 1 || record.block_num >= NUM_BLOCKS) {
+      fprintf(stderr, "%s is truncated\n", in_path);
+      ret = 1;
+    } else if (write_block(record.block_num, record.data) < 0) {
+      fprintf(stderr, "failed to write block %d\n", record.block_num);
+      ret = 1;
+    }
+  }
+  if (ret == 0 && header.has_aux) {
+    char aux[RAW_AUX_SIZE];
+    if (fread(aux, sizeof(aux), 1, in) != 1) {
+      fprintf(stderr, "%s is truncated\n", in_path);
+      ret = 1;
+    } else if (raw_write_aux(0, aux, sizeof(aux)) < 0) {
+      fprintf(stderr, "failed to write the aux area\n");
+      ret = 1;
+    }
+  }
+  fclose(in);
+  if (ret == 0 && raw_set_applied_checkpoint(header.until) < 0) {
+    fprintf(stderr, "failed to record checkpoint %u in the image\n", header.until);
+    ret = 1;
+  }
+  if (ret == 0) {
+    printf("%u blocks%s applied (checkpoint %u to %u)\n", header.num_blocks,
+           header.has_aux ? " and the aux area" : "", header.since, header.until);
+  }
+  return ret;
+}
+
+
+int main(int argc, char* argv[]) {
+  const char* disk = DISK_FILENAME;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:")) != -1) {
+    switch (opt) {
+    case 'd':
+      disk = optarg;
+      break;
+    default:
+      optind = argc; // print the usage below
+    }
+  }
+  const char* command = optind < argc ? argv[optind] : "";
+  int num_args = argc - optind - 1;
+  if (!((0 == strcmp(command, "checkpoint") && num_args == 0) ||
+        (0 == strcmp(command, "export-incremental") && num_args == 2) ||
+        (0 == strcmp(command, "apply-incremental") && num_args == 1))) {
+    fprintf(stderr, "usage: %s [-d image_file] checkpoint\n"
+                    "       %s [-d image_file] export-incremental <checkpoint> <backup_file>\n"
+                    "       %s [-d image_file] apply-incremental <backup_file>\n"
+                    "  checkpoint          start tracking changes from now on\n"
+                    "  export-incremental  write the blocks changed since a checkpoint (0 for\n"
+                    "                      all of them) to backup_file, and take a new checkpoint\n"
+                    "  apply-incremental   write the blocks in backup_file to the image; apply a\n"
+                    "                      full backup first, then each incremental one in order\n"
+                    "                      (others are refused)\n"
+                    "  -d  use this image instead of " DISK_FILENAME " (it must not be mounted)\n",
+            argv[0], argv[0], argv[0]);
+    return 1;
+  }
+
+  if (raw_mount(disk) < 0) {
+    perror("FATAL ERROR: failed to mount image");
+    return 1;
+  }
+  int ret = 0;
+  if (0 == strcmp(command, "checkpoint")) {
+    uint32_t checkpoint = raw_checkpoint();
+    if (checkpoint == 0) {
+      fprintf(stderr, "failed to take a checkpoint\n");
+      ret = 1;
+    } else {
+      printf("Checkpoint %u\n", checkpoint);
+    }
+  } else if (0 == strcmp(command, "export-incremental")) {
+    ret = export_incremental(strtoul(argv[optind + 1], NULL, 10), argv[optind + 2]);
+  } else {
+    ret = apply_incremental(argv[optind + 1]);
+  }
+  if (raw_unmount() < 0) {
+    ret = 1;
+  }
+  return ret;
+}
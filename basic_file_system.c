@@ -1,85 +1,455 @@
 #include "basic_file_system.h"
+#include "extent_tree.h"
+#include "crc32c.h"
+#include <pthread.h>
+#include <string.h>
+
+// maximum number of extra references a shared block can have
+#define MAX_EXTRA_REFS 255
+
+// Per-block count of extra references (beyond the owner that allocated it),
+// persisted in the raw disk's auxiliary area.  0 for every unshared block.
+#define REFCOUNT_TABLE_OFFSET 0
+static uint8_t extra_refs[NUM_BLOCKS];
+
+
+// writes one block's entry of the reference count table back to disk
+static int store_extra_refs(block_num_t block) {
+  return raw_write_aux(REFCOUNT_TABLE_OFFSET + block, &extra_refs[block], 1);
+}
+
+
+// The superblock's bitmap (one bit per block, 1 = allocated), kept in memory
+// and written through to block 0 on every change.  The block space is split
+// into NUM_ALLOC_GROUPS allocation groups of ALLOC_GROUP_BLOCKS blocks, each
+// with its own free count, so that allocations near a goal stay in the goal's
+// group and skip full groups without scanning them.  A single lock protects
+// the bitmap, the free counts, extra_refs and the extent tree below, and is
+// held until a change is written back: the bitmap is one block, and jfs
+// allocates under its own exclusive fs_lock anyway.
+static unsigned char bitmap[BLOCK_SIZE];
+static int group_free[NUM_ALLOC_GROUPS];
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define GROUP_OF(block) ((block) / ALLOC_GROUP_BLOCKS)
+
+
+// With bfs_use_extent_tree(), free space is also indexed as a tree of free
+// extents, which allocations are then served from: the bitmap stays the
+// authoritative copy on disk and is kept up to date as before, so a block in
+// the tree is always free in the bitmap.
+static struct extent_tree free_extents;
+static int use_extent_tree;
+
+// The tree is saved to the aux area (after the refcount table and the jfs
+// snapshot table) at unmount, and loaded at the next mount if it's marked
+// clean and the bitmap still matches the one it was saved with; otherwise it
+// is rebuilt from the bitmap.  It's marked dirty while mounted.
+#define EXTENT_TABLE_OFFSET (2 * NUM_BLOCKS)
+#define MAX_FREE_EXTENTS (NUM_BLOCKS / 2)
+struct extent_table {
+  uint32_t clean;        // 1 if the extents below are up to date
+  uint32_t bitmap_crc;   // crc32c of the bitmap they were saved with
+  uint32_t num_extents;
+  struct {
+    block_num_t start;
+    block_num_t length;
+  } extents[MAX_FREE_EXTENTS];
+};
+
+
+static int test_bit(int block) {
+  return bitmap[block / 8] & (1 << (block % 8));
+}
+
+static void set_bit(int block) {
+  bitmap[block / 8] |= 1 << (block % 8);
+  group_free[GROUP_OF(block)]--;
+}
+
+static void clear_bit(int block) {
+  bitmap[block / 8] &= ~(1 << (block % 8));
+  group_free[GROUP_OF(block)]++;
+}
+
+
+// writes the bitmap back to the superblock; the caller holds alloc_lock
+static int store_bitmap() {
+  return write_block(0, bitmap);
+}
 
 
 int bfs_mount(const char* filename) {
+  return bfs_mount_striped(&filename, 1, 1);
+}
+
+
+int bfs_mount_striped(const char* const filenames[], int count, int unit) {
   // mount the raw disk
-  if (raw_mount(filename) < 0) {
+  if (raw_mount_striped(filenames, count, unit) < 0) {
     return -1;
   }
 
   // read the superblock
-  char superblock[BLOCK_SIZE];
-  if (read_block(0, superblock) < 0) {
+  if (read_block(0, bitmap) < 0) {
     return -1;
   }
 
   // make sure the superblock and root directory are marked "allocated"
-  if (!(superblock[0] & 3)) {
-    superblock[0] |= 3;
-    if (write_block(0, superblock) < 0) {
+  if (!(bitmap[0] & 3)) {
+    bitmap[0] |= 3;
+    if (write_block(0, bitmap) < 0) {
       return -1;
     }
   }
+
+  // count each group's free blocks
+  for (int group = 0; group < NUM_ALLOC_GROUPS; group++) {
+    group_free[group] = ALLOC_GROUP_BLOCKS;
+    for (int byte = group * ALLOC_GROUP_BLOCKS / 8; byte < (group + 1) * ALLOC_GROUP_BLOCKS / 8; byte++) {
+      group_free[group] -= __builtin_popcount(bitmap[byte]);
+    }
+  }
+
+  // load the reference count table
+  if (raw_read_aux(REFCOUNT_TABLE_OFFSET, extra_refs, sizeof(extra_refs)) < 0) {
+    return -1;
+  }
   return 0;
 }
 
 
-block_num_t allocate_block() {
-  // read the superblock
-  char superblock[BLOCK_SIZE];
-  if (read_block(0, superblock) < 0) {
+// loads the saved extent table into free_extents if it is clean and matches
+// the bitmap
+// returns 1 if it was loaded, or 0 if not
+static int load_extent_table() {
+  struct extent_table table;
+  if (raw_read_aux(EXTENT_TABLE_OFFSET, &table, sizeof(table)) < 0 || table.clean != 1 ||
+      table.bitmap_crc != crc32c(0, bitmap, sizeof(bitmap)) || table.num_extents > MAX_FREE_EXTENTS) {
     return 0;
   }
+  for (uint32_t i = 0; i < table.num_extents; i++) {
+    if (table.extents[i].start == 0 || table.extents[i].start + table.extents[i].length > NUM_BLOCKS ||
+        extent_tree_add(&free_extents, table.extents[i].start, table.extents[i].length) < 0) {
+      extent_tree_clear(&free_extents);
+      return 0;
+    }
+  }
+  return 1;
+}
+
 
-  // find the first byte that is all allocated
-  int byte;
-  for (byte = 0;
-       byte < BLOCK_SIZE && superblock[byte] == (char)-1;
-       byte++) {}
-  // if all bytes are all allocated, then there are no free blocks
-  if (byte == BLOCK_SIZE) {
-    return 0; // no free blocks
+// adds every run of free blocks in the bitmap to free_extents
+static void build_extent_tree() {
+  for (int block = 1; block < NUM_BLOCKS; ) {
+    if (test_bit(block)) {
+      block++;
+      continue;
+    }
+    int start = block;
+    while (block < NUM_BLOCKS && !test_bit(block)) {
+      block++;
+    }
+    extent_tree_add(&free_extents, start, block - start);
   }
+}
 
-  // find the bit index of the first 0 bit
-  unsigned char field = superblock[byte];
-  int bit;
-  for (bit = 0; field & 1 && bit < 8; field >>= 1, bit++) {}
-  if (bit == 8) {
-    // this should be impossible because we checked that the byte is not all 1's
+
+// writes the clean flag (and, when clean, the extents) of the saved table
+static int store_extent_table(int clean) {
+  struct extent_table table;
+  memset(&table, 0, sizeof(table));
+  table.clean = clean;
+  if (clean) {
+    table.bitmap_crc = crc32c(0, bitmap, sizeof(bitmap));
+    struct free_extent extent;
+    for (uint32_t from = 0; extent_tree_find(&free_extents, from, &extent) == 0;
+         from = extent.start + extent.length) {
+      table.extents[table.num_extents].start = extent.start;
+      table.extents[table.num_extents].length = extent.length;
+      table.num_extents++;
+    }
+  }
+  return raw_write_aux(EXTENT_TABLE_OFFSET, &table, clean ? sizeof(table) : sizeof(table.clean));
+}
+
+
+int bfs_use_extent_tree() {
+  if (use_extent_tree) {
     return 0;
   }
+  if (extent_tree_init(&free_extents, MAX_FREE_EXTENTS) < 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&alloc_lock);
+  int loaded = load_extent_table();
+  if (!loaded) {
+    build_extent_tree();
+  }
+  // from now on the saved copy falls behind
+  if (store_extent_table(0) < 0) {
+    extent_tree_destroy(&free_extents);
+    loaded = -1;
+  } else {
+    use_extent_tree = 1;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return loaded;
+}
+
+
+// finds the first run of count blocks in free_extents that starts at or
+// after from and before end; the caller holds alloc_lock
+// returns the first block of the run, or 0 if there is none
+static block_num_t find_free_extent(int count, uint32_t from, uint32_t end) {
+  struct free_extent extent;
+  while (from < end && extent_tree_find(&free_extents, from, &extent) == 0 && extent.start < end) {
+    uint32_t start = extent.start > from ? extent.start : from;
+    if (extent.start + extent.length - start >= (uint32_t) count) {
+      return start;
+    }
+    from = extent.start + extent.length;
+  }
+  return 0;
+}
 
-  // set the found bit of the byte to 1
-  superblock[byte] |= 1 << bit;
 
+// allocates the first run of count blocks in free_extents that starts at or
+// after goal, wrapping around to the first one before it (the same order as
+// the bitmap); the caller holds alloc_lock
+// returns the first block allocated, or 0 if there is no room
+static block_num_t take_from_extent_tree(int count, block_num_t goal) {
+  uint32_t start = find_free_extent(count, goal, NUM_BLOCKS);
+  if (start == 0) {
+    start = find_free_extent(count, 0, goal);
+  }
+  if (start == 0 || extent_tree_take(&free_extents, start, count) < 0) {
+    return 0;
+  }
+
+  for (uint32_t block = start; block < start + count; block++) {
+    set_bit(block);
+  }
   // write the updated superblock back to disk
-  if (write_block(0, superblock) < 0) {
+  if (store_bitmap() < 0) {
+    for (uint32_t block = start; block < start + count; block++) {
+      clear_bit(block);
+    }
+    extent_tree_add(&free_extents, start, count);
     return 0;
   }
-  return byte * 8 + bit;
+  return start;
 }
 
 
-int release_block(block_num_t block) {
-  // read the superblock
-  char superblock[BLOCK_SIZE];
-  if (read_block(0, superblock) < 0) {
-    return -1;
+block_num_t allocate_block() {
+  return allocate_block_near(0);
+}
+
+
+// allocates the first free block of a group at or after from (wrapping around
+// to the start of the group); the caller holds alloc_lock
+// returns the block, or 0 if the group is full
+static block_num_t take_block_in_group(int group, int from) {
+  int first = group * ALLOC_GROUP_BLOCKS;
+  for (int i = 0; i < ALLOC_GROUP_BLOCKS; i++) {
+    int block = first + (from - first + i) % ALLOC_GROUP_BLOCKS;
+    // skip bytes that are all allocated
+    if (block % 8 == 0 && bitmap[block / 8] == 0xff) {
+      i += 7;
+      continue;
+    }
+    if (!test_bit(block)) {
+      set_bit(block);
+      return block;
+    }
+  }
+  return 0;
+}
+
+
+block_num_t allocate_block_near(block_num_t goal) {
+  if (goal >= NUM_BLOCKS) {
+    goal = 0;
+  }
+  pthread_mutex_lock(&alloc_lock);
+  block_num_t block = 0;
+  if (use_extent_tree) {
+    block = take_from_extent_tree(1, goal);
+    pthread_mutex_unlock(&alloc_lock);
+    return block;
+  }
+
+  // try goal's group first, then the following ones
+  int goal_group = GROUP_OF(goal);
+  for (int i = 0; i < NUM_ALLOC_GROUPS && block == 0; i++) {
+    int group = (goal_group + i) % NUM_ALLOC_GROUPS;
+    if (group_free[group] > 0) {
+      block = take_block_in_group(group, i == 0 ? goal : group * ALLOC_GROUP_BLOCKS);
+    }
+  }
+
+  // write the updated superblock back to disk
+  if (block != 0 && store_bitmap() < 0) {
+    clear_bit(block);
+    block = 0;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return block;
+}
+
+
+// finds the first run of count free blocks within [from, to) of the bitmap
+// returns the first block of the run, or 0 if there is none
+static block_num_t find_free_run(int count, int from, int to) {
+  int run = 0;
+  for (int block = from; block < to; block++) {
+    if (test_bit(block)) {
+      run = 0;
+    } else if (++run == count) {
+      return block - count + 1;
+    }
   }
+  return 0;
+}
 
+
+block_num_t allocate_contiguous(int count, block_num_t goal) {
+  if (count < 1 || count >= NUM_BLOCKS) {
+    return 0;
+  }
+  if (count == 1) {
+    return allocate_block_near(goal);
+  }
+  pthread_mutex_lock(&alloc_lock);
+  if (use_extent_tree) {
+    block_num_t start = take_from_extent_tree(count, goal);
+    pthread_mutex_unlock(&alloc_lock);
+    return start;
+  }
+
+  // look for a run after goal first, then wrap around to the beginning
+  block_num_t start = find_free_run(count, goal, NUM_BLOCKS);
+  if (start == 0) {
+    start = find_free_run(count, 1, goal + count - 1 < NUM_BLOCKS ? goal + count - 1 : NUM_BLOCKS);
+  }
+
+  if (start != 0) {
+    // mark the run allocated, and write the updated superblock back to disk
+    for (int block = start; block < start + count; block++) {
+      set_bit(block);
+    }
+    if (store_bitmap() < 0) {
+      for (int block = start; block < start + count; block++) {
+        clear_bit(block);
+      }
+      start = 0;
+    }
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return start; // (0 if no run that long is free)
+}
+
+
+// drops one reference to a block, freeing it with its last reference; the
+// caller holds alloc_lock
+// returns 1 if the bitmap changed, 0 if not, or -1 on failure
+static int put_block(block_num_t block) {
+  if (extra_refs[block] > 0) {
+    // a shared block just loses one of its references
+    extra_refs[block]--;
+    return store_extra_refs(block);
+  }
+  if (!test_bit(block)) {
+    return 0;
+  }
   // change bit corresponding to block num to 0
-  char mask = 1 << (block % 8);
-  superblock[block / 8] &= ~mask;
+  clear_bit(block);
+  if (use_extent_tree) {
+    extent_tree_add(&free_extents, block, 1);
+  }
+  return 1;
+}
 
+
+int release_block(block_num_t block) {
+  pthread_mutex_lock(&alloc_lock);
+  int ret = put_block(block);
   // write the updated superblock back to disk
-  if (write_block(0, superblock) < 0) {
+  if (ret > 0) {
+    ret = store_bitmap() < 0 ? -1 : 0;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return ret;
+}
+
+
+int release_blocks(const block_num_t* blocks, int count) {
+  int changed = 0;
+  int ret = 0;
+  pthread_mutex_lock(&alloc_lock);
+  for (int i = 0; i < count && ret == 0; i++) {
+    int put = put_block(blocks[i]);
+    if (put < 0) {
+      ret = -1;
+    }
+    changed |= put > 0;
+  }
+
+  // write the updated superblock back to disk, once
+  if (changed && store_bitmap() < 0) {
+    ret = -1;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return ret;
+}
+
+
+int share_block(block_num_t block) {
+  if (block == 0 || block >= NUM_BLOCKS) {
     return -1;
   }
-  return 0;
+  int ret = -1;
+  pthread_mutex_lock(&alloc_lock);
+  if (extra_refs[block] < MAX_EXTRA_REFS) {
+    extra_refs[block]++;
+    ret = store_extra_refs(block);
+    if (ret < 0) {
+      extra_refs[block]--;
+    }
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return ret;
+}
+
+
+int block_ref_count(block_num_t block) {
+  if (block >= NUM_BLOCKS) {
+    return -1;
+  }
+  pthread_mutex_lock(&alloc_lock);
+  int ret = test_bit(block) ? 1 + extra_refs[block] : 0; // 0 if free
+  pthread_mutex_unlock(&alloc_lock);
+  return ret;
+}
+
+
+int count_free_blocks() {
+  int num_free = 0;
+  pthread_mutex_lock(&alloc_lock);
+  for (int group = 0; group < NUM_ALLOC_GROUPS; group++) {
+    num_free += group_free[group];
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return num_free;
 }
 
 
 int bfs_unmount() {
+  if (use_extent_tree) {
+    store_extent_table(1);
+    extent_tree_destroy(&free_extents);
+    use_extent_tree = 0;
+  }
   return raw_unmount();
 }
@@ -3,8 +3,30 @@
 
 #include "raw_disk.h"
 
+// The block space is split into allocation groups, each with its own part of
+// the free block bitmap and free count: blocks allocated near a goal come from
+// the goal's group when it has room, and full groups are skipped without
+// being scanned.
+#define ALLOC_GROUP_BLOCKS 64
+#define NUM_ALLOC_GROUPS (NUM_BLOCKS / ALLOC_GROUP_BLOCKS)
+
 int bfs_mount(const char* filename);
 
+// same as bfs_mount, but stripes the disk across several image files (see
+// raw_mount_striped)
+int bfs_mount_striped(const char* const filenames[], int count, int unit);
+
+/* bfs_use_extent_tree
+ *   serves allocations from a tree of free extents (see extent_tree.h)
+ *   instead of by scanning the bitmap, which is still kept up to date on
+ *   disk; the tree is loaded from where the last unmount saved it if the
+ *   bitmap hasn't changed since, and rebuilt from the bitmap otherwise.  Call
+ *   it right after mounting; it lasts until bfs_unmount()
+ * returns 1 if the saved tree was loaded, 0 if it was rebuilt, or -1 on
+ *   failure
+ */
+int bfs_use_extent_tree();
+
 /* allocate_block
  *   allocates a new block - finds a block that not yet allocated, marks it as
  *   allocated, and returns its block number - blocks marked as allocated will
@@ -16,9 +38,31 @@ int bfs_mount(const char* filename);
  */
 block_num_t allocate_block();
 
+/* allocate_block_near
+ *   same as allocate_block(), but prefers the first free block at or after
+ *   goal in goal's allocation group, then the following groups in turn (so
+ *   that related blocks - an inode and its data, or a directory and its
+ *   entries - end up close together)
+ * goal - block number to allocate near
+ * returns the block number of the allocated block on succes, or 0 on failure
+ */
+block_num_t allocate_block_near(block_num_t goal);
+
+/* allocate_contiguous
+ *   allocates a run of consecutive free blocks, preferring the first run
+ *   that starts at or after goal (so related blocks end up close together),
+ *   then the first one before it
+ * count - number of blocks to allocate
+ * goal - block number to start searching from
+ * returns the block number of the first block of the run on success, or 0 on
+ * failure (when there is no run of count free blocks on the disk)
+ */
+block_num_t allocate_contiguous(int count, block_num_t goal);
+
 /* release_block
  *   releases the specified disk block, allowing it to be allocated again by
- *   allocate_block() sometime in the future
+ *   allocate_block() sometime in the future (if the block is shared, this
+ *   only drops one reference; the block is freed with its last reference)
  * block - number of the block to release
  * returns 0 on success and -1 on failure
  * (Failure of release_block() should only happen if there is an error
@@ -27,6 +71,38 @@ block_num_t allocate_block();
  */
 int release_block(block_num_t block);
 
+/* release_blocks
+ *   releases a batch of blocks, exactly like calling release_block() on each
+ *   of them, but reading and writing the superblock only once
+ * blocks - numbers of the blocks to release
+ * count - number of entries in blocks
+ * returns 0 on success and -1 on failure
+ */
+int release_blocks(const block_num_t* blocks, int count);
+
+/* share_block
+ *   adds a reference to an allocated block, so that it is shared by one more
+ *   owner; a shared block is only freed once release_block() has been called
+ *   once for each of its references
+ * block - number of the (already allocated) block to share
+ * returns 0 on success and -1 on failure (including when the block already
+ *   has the maximum number of references)
+ */
+int share_block(block_num_t block);
+
+/* block_ref_count
+ *   returns the number of references to a block: 0 if it is free, 1 if it has
+ *   a single owner, or more if it has been shared with share_block(), or -1 on
+ *   failure
+ */
+int block_ref_count(block_num_t block);
+
+/* count_free_blocks
+ *   returns the number of blocks that allocate_block() can still hand out, or
+ *   -1 on failure
+ */
+int count_free_blocks();
+
 int bfs_unmount();
 
 #endif // _BASIC_FILE_SYSTEM_H_
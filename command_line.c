@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "jumbo_file_system.h"
 
 #define DISK_FILENAME "DISK"
@@ -41,6 +42,18 @@ void print_error(int err, const char* name) {
     case E_DISK_FULL:
       printf("disk is full");
       break;
+    case E_CHECKSUM:
+      printf("%s is corrupted (checksum mismatch)\n", name);
+      break;
+    case E_INVALID:
+      printf("invalid argument: %s\n", name);
+      break;
+    case E_READ_ONLY:
+      printf("read-only file system (a snapshot is mounted)\n");
+      break;
+    case E_MAX_SNAPSHOTS:
+      printf("too many snapshots (max %d)\n", MAX_SNAPSHOTS);
+      break;
     case E_UNKNOWN:
       printf("an unknown error occurred\n");
       break;
@@ -50,6 +63,25 @@ void print_error(int err, const char* name) {
 }
 
 
+/* print_find_entry
+ *   jfs_find() callback that prints each path (directories end with a '/')
+ */
+int print_find_entry(const char* path, const struct stats* buf, void* arg) {
+  (void) arg;
+  printf("%s%s\n", path, buf->is_dir || 0 == strcmp(path, "/") ? "" : "/");
+  return 0;
+}
+
+
+/* print_transfer_stats
+ *   prints the results of an import or export
+ */
+void print_transfer_stats(const struct transfer_stats* stats) {
+  printf("%u files (%u bytes), %u directories copied; %u skipped\n",
+         stats->files, stats->bytes, stats->directories, stats->skipped);
+}
+
+
 /* run_command
  *   Runs one entire command line, which may include multiple pipeline stages
  */
@@ -73,7 +105,7 @@ void run_command(char* command_line) {
 
   } else if (0 == strcmp(tokens[0], "cd")) {
     if (NULL != tokens[2]) {
-      fprintf(stderr, "usage: cd [dir_name]\n(dir_name is optional; leaving it out will return to the root directory)\n");
+      fprintf(stderr, "usage: cd [dir_path]\n(dir_path is optional; leaving it out will return to the root directory)\n");
       return;
     }
 
@@ -83,7 +115,7 @@ void run_command(char* command_line) {
 
   } else if (0 == strcmp(tokens[0], "mkdir")) {
     if (NULL == tokens[1] || NULL != tokens[2]) {
-      fprintf(stderr, "usage: mkdir <dir_name>\n");
+      fprintf(stderr, "usage: mkdir <dir_path>\n");
       return;
     }
     int ret = jfs_mkdir(tokens[1]);
@@ -91,56 +123,102 @@ void run_command(char* command_line) {
 
   } else if (0 == strcmp(tokens[0], "rmdir")) {
     if (NULL == tokens[1] || NULL != tokens[2]) {
-      fprintf(stderr, "usage: rmdir <dir_name>\n");
+      fprintf(stderr, "usage: rmdir <dir_path>\n");
       return;
     }
     int ret = jfs_rmdir(tokens[1]);
     print_error(ret, tokens[1]);
 
   } else if (0 == strcmp(tokens[0], "ls")) {
-    if (NULL != tokens[1]) {
-      fprintf(stderr, "usage: ls\n");
+    if (NULL != tokens[1] && NULL != tokens[2]) {
+      fprintf(stderr, "usage: ls [dir_path]\n");
       return;
     }
 
-    char* directories[MAX_DIR_ENTRIES+1];
-    char* files[MAX_DIR_ENTRIES+1];
-    memset(directories, -1, MAX_DIR_ENTRIES * sizeof(const char*));
-    memset(files,       -1, MAX_DIR_ENTRIES * sizeof(const char*));
-    int ret = jfs_ls(directories, files);
+    struct jfs_dir dir;
+    struct jfs_dirent entries[MAX_DIR_ENTRIES];
+    int num_entries = 0;
+    int ret = jfs_opendir(tokens[1], &dir);
 
     if (E_SUCCESS == ret) {
-      for (int i = 0; NULL != directories[i]; i++) {
-        printf("%s/\n", directories[i]);
-        free(directories[i]);
+      while (jfs_readdir(&dir, &entries[num_entries])) {
+        num_entries++;
       }
-      for (int i = 0; NULL != files[i]; i++) {
-        printf("%s\n", files[i]);
-        free(files[i]);
+      // directories first, then files
+      for (int i = 0; i < num_entries; i++) {
+        if (!entries[i].is_dir) {
+          printf("%s/\n", entries[i].name);
+        }
+      }
+      for (int i = 0; i < num_entries; i++) {
+        if (entries[i].is_dir) {
+          printf("%s\n", entries[i].name);
+        }
       }
     } else {
-      printf("ls failed - but ls should never fail!\n");
+      // (even the current directory can fail, if its block is corrupted)
+      print_error(ret, NULL == tokens[1] ? "." : tokens[1]);
     }
 
   } else if (0 == strcmp(tokens[0], "touch")) {
     if (NULL == tokens[1] || NULL != tokens[2]) {
-      fprintf(stderr, "usage: touch <file_name>\n");
+      fprintf(stderr, "usage: touch <file_path>\n");
       return;
     }
     int ret = jfs_creat(tokens[1]);
     print_error(ret, tokens[1]);
 
   } else if (0 == strcmp(tokens[0], "rm")) {
+    if (NULL != tokens[1] && 0 == strcmp(tokens[1], "-r")) {
+      if (NULL == tokens[2]) {
+        fprintf(stderr, "usage: rm -r <path>\n");
+        return;
+      }
+      int ret = jfs_remove_tree(tokens[2]);
+      print_error(ret, tokens[2]);
+      return;
+    }
     if (NULL == tokens[1] || NULL != tokens[2]) {
-      fprintf(stderr, "usage: rm <file_name>\n");
+      fprintf(stderr, "usage: rm [-r] <file_path>\n");
       return;
     }
     int ret = jfs_remove(tokens[1]);
     print_error(ret, tokens[1]);
 
+  } else if (0 == strcmp(tokens[0], "mv")) {
+    if (NULL == tokens[1] || NULL == tokens[2]) {
+      fprintf(stderr, "usage: mv <path> <new_path | dir_path>\n");
+      return;
+    }
+    int ret = jfs_rename(tokens[1], tokens[2]);
+    print_error(ret, E_EXISTS == ret || E_INVALID == ret ? tokens[2] : tokens[1]);
+
+  } else if (0 == strcmp(tokens[0], "du")) {
+    if (NULL != tokens[2]) {
+      fprintf(stderr, "usage: du [path]\n");
+      return;
+    }
+
+    struct usage usage;
+    int ret = jfs_du(tokens[1], &usage);
+    if (E_SUCCESS == ret) {
+      printf("%u blocks\t%u bytes\t%s\n", usage.num_blocks, usage.num_bytes,
+             NULL == tokens[1] ? "." : tokens[1]);
+    } else {
+      print_error(ret, tokens[1]);
+    }
+
+  } else if (0 == strcmp(tokens[0], "find")) {
+    if (NULL != tokens[2]) {
+      fprintf(stderr, "usage: find [path]\n");
+      return;
+    }
+    int ret = jfs_find(tokens[1], print_find_entry, NULL);
+    print_error(ret, tokens[1]);
+
   } else if (0 == strcmp(tokens[0], "stat")) {
     if (NULL == tokens[1] || NULL != tokens[2]) {
-      fprintf(stderr, "usage: stat <file_name>\n");
+      fprintf(stderr, "usage: stat <path>\n");
       return;
     }
 
@@ -165,19 +243,21 @@ void run_command(char* command_line) {
 
   } else if (0 == strcmp(tokens[0], "cat")) {
     if (NULL == tokens[1] || NULL != tokens[2]) {
-      fprintf(stderr, "usage: cat <file_name>\n");
+      fprintf(stderr, "usage: cat <file_path>\n");
       return;
     }
 
-    unsigned short bytes_read = MAX_FILE_SIZE;
-    char file_data[MAX_FILE_SIZE];
-    memset(file_data, -1, MAX_FILE_SIZE);
-    int ret = jfs_read(tokens[1], file_data, &bytes_read);
+    // write the data straight from the block cache
+    struct jfs_view view;
+    int ret = jfs_read_view(tokens[1], MAX_FILE_SIZE, &view);
 
     if (E_SUCCESS == ret) {
-      ret = write(STDOUT_FILENO, file_data, bytes_read);
+      fflush(stdout);
+      ssize_t length = view.length;
+      ssize_t written = view.iovcnt > 0 ? writev(STDOUT_FILENO, view.iov, view.iovcnt) : 0;
+      jfs_release_view(&view);
       printf("\n");
-      if (ret != bytes_read) {
+      if (written != length) {
         perror("Failed to write file data to stdout");
       }
     } else {
@@ -186,13 +266,127 @@ void run_command(char* command_line) {
 
   } else if (0 == strcmp(tokens[0], "append")) {
     if (NULL == tokens[1] || NULL == tokens[2]) {
-      fprintf(stderr, "usage: append <file_name> <data>\n");
+      fprintf(stderr, "usage: append <file_path> <data>\n");
       return;
     }
 
     int ret = jfs_write(tokens[1], tokens[2], strlen(tokens[2]));
     print_error(ret, tokens[1]);
 
+  } else if (0 == strcmp(tokens[0], "import")) {
+    if (NULL == tokens[1] || NULL != tokens[2]) {
+      fprintf(stderr, "usage: import <host_dir>\n");
+      return;
+    }
+
+    struct transfer_stats transfer_stats;
+    int ret = jfs_import(tokens[1], &transfer_stats);
+    if (E_SUCCESS == ret) {
+      print_transfer_stats(&transfer_stats);
+    } else {
+      print_error(ret, tokens[1]);
+    }
+
+  } else if (0 == strcmp(tokens[0], "export")) {
+    if (NULL == tokens[1]) {
+      fprintf(stderr, "usage: export [path] <host_path>\n(leaving out path exports the current directory)\n");
+      return;
+    }
+
+    // with one argument, export the current directory
+    const char* name = NULL == tokens[2] ? NULL : tokens[1];
+    const char* host_path = NULL == tokens[2] ? tokens[1] : tokens[2];
+    struct transfer_stats transfer_stats;
+    int ret = jfs_export(name, host_path, &transfer_stats);
+    if (E_SUCCESS == ret) {
+      print_transfer_stats(&transfer_stats);
+    } else {
+      print_error(ret, name);
+    }
+
+  } else if (0 == strcmp(tokens[0], "defrag")) {
+    if (NULL != tokens[1]) {
+      fprintf(stderr, "usage: defrag\n");
+      return;
+    }
+
+    struct defrag_stats defrag_stats;
+    jfs_defrag(&defrag_stats);
+    printf("Files examined: %u\n", defrag_stats.files_examined);
+    printf("Files moved: %u (%u blocks)\n", defrag_stats.files_moved, defrag_stats.blocks_moved);
+    printf("Files skipped: %u\n", defrag_stats.files_skipped);
+    printf("Extents: %u before, %u after\n", defrag_stats.extents_before, defrag_stats.extents_after);
+
+  } else if (0 == strcmp(tokens[0], "diskstats")) {
+    if (NULL != tokens[1]) {
+      fprintf(stderr, "usage: diskstats\n");
+      return;
+    }
+
+    struct raw_stats disk_stats;
+    jfs_disk_stats(&disk_stats);
+    printf("Block reads: %llu\n", (unsigned long long) disk_stats.reads);
+    printf("Block writes: %llu\n", (unsigned long long) disk_stats.writes);
+    printf("Checksum errors: %llu\n", (unsigned long long) disk_stats.checksum_errors);
+    printf("Cache hits: %llu\n", (unsigned long long) disk_stats.cache_hits);
+    printf("Blocks prefetched: %llu\n", (unsigned long long) disk_stats.prefetched);
+    printf("Syncs: %llu\n", (unsigned long long) disk_stats.syncs);
+
+  } else if (0 == strcmp(tokens[0], "checkpoint")) {
+    if (NULL != tokens[1]) {
+      fprintf(stderr, "usage: checkpoint\n");
+      return;
+    }
+
+    uint32_t checkpoint = jfs_checkpoint();
+    if (0 == checkpoint) {
+      fprintf(stderr, "ERROR: checkpoint failed\n");
+    } else {
+      printf("Checkpoint %u\n", checkpoint);
+    }
+
+  } else if (0 == strcmp(tokens[0], "snapshot")) {
+    if (NULL != tokens[1] && 0 == strcmp(tokens[1], "-d")) {
+      if (NULL == tokens[2]) {
+        fprintf(stderr, "usage: snapshot -d <name>\n");
+        return;
+      }
+      int ret = jfs_snapshot_delete(tokens[2]);
+      if (E_NOT_EXISTS == ret) {
+        printf("snapshot not found: %s\n", tokens[2]);
+      } else {
+        print_error(ret, tokens[2]);
+      }
+      return;
+    }
+    if (NULL != tokens[2]) {
+      fprintf(stderr, "usage: snapshot [-d] [name]\n(leaving out name lists the snapshots)\n");
+      return;
+    }
+    if (NULL != tokens[1]) {
+      print_error(jfs_snapshot_create(tokens[1]), tokens[1]);
+      return;
+    }
+
+    struct jfs_snapshot snapshots[MAX_SNAPSHOTS];
+    int count = jfs_snapshot_list(snapshots, MAX_SNAPSHOTS);
+    for (int i = 0; i < count; i++) {
+      time_t created = snapshots[i].created;
+      char when[32];
+      strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+      printf("%-8s %s\n", snapshots[i].name, when);
+    }
+
+  } else if (0 == strcmp(tokens[0], "sync")) {
+    if (NULL != tokens[1]) {
+      fprintf(stderr, "usage: sync\n");
+      return;
+    }
+
+    if (jfs_sync() < 0) {
+      fprintf(stderr, "ERROR: sync failed\n");
+    }
+
   } else {
     fprintf(stderr, "ERROR: unrecognized command\n");
   }
@@ -229,9 +423,70 @@ void prompt_for_input(char* input_buffer, int buflen) {
 }
 
 
-int main() {
+int main(int argc, char* argv[]) {
   char input_buffer[MAX_CMD_LENGTH];
 
+  // parse mount options
+  struct mount_options options;
+  memset(&options, 0, sizeof(options));
+  const char* stripe_files[MAX_STRIPE_MEMBERS];
+  options.stripe_files = stripe_files;
+  options.stripe_unit = 1;
+  const char* trace_file = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "dDeMm:s:S:t:u:")) != -1) {
+    switch (opt) {
+    case 'd':
+      options.flags |= JFS_MOUNT_DEDUP;
+      break;
+    case 'D':
+      options.flags |= JFS_MOUNT_DIRECT_IO;
+      break;
+    case 'e':
+      options.flags |= JFS_MOUNT_EXTENT_ALLOC;
+      break;
+    case 'M':
+      options.flags |= JFS_MOUNT_METADATA_CACHE;
+      break;
+    case 's':
+      if (jfs_parse_durability(optarg, &options) < 0) {
+        fprintf(stderr, "unknown durability policy: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'S':
+      options.snapshot = optarg;
+      break;
+    case 'm':
+      if (options.num_stripe_files == MAX_STRIPE_MEMBERS) {
+        fprintf(stderr, "at most %d stripe members are supported\n", MAX_STRIPE_MEMBERS);
+        return 1;
+      }
+      stripe_files[options.num_stripe_files++] = optarg;
+      break;
+    case 't':
+      trace_file = optarg;
+      break;
+    case 'u':
+      options.stripe_unit = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-d] [-D] [-e] [-M] [-s durability] [-S snapshot] [-m image_file]... [-u stripe_unit] [-t trace_file]\n"
+                      "  -d  deduplicate identical data blocks\n"
+                      "  -D  use direct I/O (O_DIRECT), bypassing the host's page cache\n"
+                      "  -e  allocate from a tree of free extents instead of scanning the bitmap\n"
+                      "  -M  keep all directories and inodes in memory (lookups, stat, ls and\n"
+                      "      cd never read the disk)\n"
+                      "  -s  when to flush changes to stable storage: none (leave it to the\n"
+                      "      host; the default), periodic[:interval_ms] or sync (after every change)\n"
+                      "  -S  mount this snapshot, read-only, instead of the live file system\n"
+                      "  -m  stripe the disk across these image files instead of " DISK_FILENAME "\n"
+                      "  -u  number of blocks per stripe unit (a power of 2; default 1)\n"
+                      "  -t  record every jfs_* call to trace_file (see ./replay)\n", argv[0]);
+      return 1;
+    }
+  }
+
   /*
   printf("File system parameters:\n");
   printf("MAX_NAME_LENGTH = %d\n", MAX_NAME_LENGTH);
@@ -243,7 +498,14 @@ int main() {
   printf("sizeof block struct = %ld\n\n", sizeof(struct block));
   */
 
-  jfs_mount(DISK_FILENAME);
+  if (jfs_mount_with_options(DISK_FILENAME, &options) < 0) {
+    perror("FATAL ERROR: failed to mount " DISK_FILENAME);
+    return 1;
+  }
+  if (NULL != trace_file && jfs_trace_start(trace_file) < 0) {
+    perror(trace_file);
+    return 1;
+  }
 
   prompt_for_input(input_buffer, MAX_CMD_LENGTH);
   while (0 != strcmp(input_buffer, "exit\n")) {
@@ -0,0 +1,82 @@
+#include "crc32c.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// reflected CRC32C polynomial
+#define CRC32C_POLY 0x82F63B78
+
+// slice-by-8 lookup tables, built on first use
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table() {
+  for (int i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc_table[0][i] = crc;
+  }
+  for (int i = 0; i < 256; i++) {
+    for (int slice = 1; slice < 8; slice++) {
+      uint32_t prev = crc_table[slice-1][i];
+      crc_table[slice][i] = (prev >> 8) ^ crc_table[0][prev & 0xff];
+    }
+  }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t len) {
+  pthread_once(&crc_table_once, build_crc_table);
+  // process 8 bytes per step
+  while (len >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc;
+    crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+          crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+          crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+          crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  // then the leftover bytes one at a time
+  while (len--) {
+    crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len) {
+  uint64_t crc64 = crc;
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t) crc64;
+  while (len--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len) {
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    return ~crc32c_hw(crc, buf, len);
+  }
+#endif
+  return ~crc32c_sw(crc, buf, len);
+}
@@ -0,0 +1,19 @@
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* crc32c
+ *   computes the CRC32C (Castagnoli) checksum of a buffer, continuing from a
+ *   previous checksum value (pass 0 to start a new checksum)
+ *   uses the SSE4.2 crc32 instruction when the CPU supports it, and a
+ *   slice-by-8 table lookup otherwise
+ * crc - checksum of the preceding data, or 0
+ * buf - data to checksum
+ * len - number of bytes in buf
+ * returns the updated checksum
+ */
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+#endif // _CRC32C_H_
@@ -0,0 +1,301 @@
+#include "extent_tree.h"
+#include <stdlib.h>
+
+#define NIL -1
+
+// the two orders the nodes are kept in
+#define BY_START 0
+#define BY_LENGTH 1
+
+struct extent_node {
+  uint32_t start;
+  uint32_t length;
+  uint32_t priority;   // a node's priority is higher than its children's, in both treaps
+  int32_t left[2];     // children in each order (unused nodes chain through left[0])
+  int32_t right[2];
+};
+
+
+static int32_t* root_of(struct extent_tree* tree, int order) {
+  return order == BY_START ? &tree->by_start : &tree->by_length;
+}
+
+
+static uint64_t node_key(const struct extent_tree* tree, int32_t node, int order) {
+  const struct extent_node* n = &tree->nodes[node];
+  return order == BY_START ? n->start : ((uint64_t) n->length << 32) | n->start;
+}
+
+
+// splits the treap rooted at root into the nodes with keys below key (*less)
+// and the others (*rest)
+static void split(struct extent_tree* tree, int order, int32_t root, uint64_t key,
+                  int32_t* less, int32_t* rest) {
+  if (root == NIL) {
+    *less = *rest = NIL;
+    return;
+  }
+  struct extent_node* n = &tree->nodes[root];
+  if (node_key(tree, root, order) < key) {
+    split(tree, order, n->right[order], key, &n->right[order], rest);
+    *less = root;
+  } else {
+    split(tree, order, n->left[order], key, less, &n->left[order]);
+    *rest = root;
+  }
+}
+
+
+// joins two treaps, where every key in less is below every key in rest
+static int32_t merge(struct extent_tree* tree, int order, int32_t less, int32_t rest) {
+  if (less == NIL) {
+    return rest;
+  }
+  if (rest == NIL) {
+    return less;
+  }
+  if (tree->nodes[less].priority > tree->nodes[rest].priority) {
+    tree->nodes[less].right[order] = merge(tree, order, tree->nodes[less].right[order], rest);
+    return less;
+  }
+  tree->nodes[rest].left[order] = merge(tree, order, less, tree->nodes[rest].left[order]);
+  return rest;
+}
+
+
+// returns the link (a root or a child pointer) that points to node
+static int32_t* link_to(struct extent_tree* tree, int order, int32_t node) {
+  uint64_t key = node_key(tree, node, order);
+  int32_t* link = root_of(tree, order);
+  while (*link != node) {
+    struct extent_node* n = &tree->nodes[*link];
+    link = key < node_key(tree, *link, order) ? &n->left[order] : &n->right[order];
+  }
+  return link;
+}
+
+
+static void insert(struct extent_tree* tree, int order, int32_t node) {
+  // go down to where node's priority puts it, and split what's there
+  uint64_t key = node_key(tree, node, order);
+  uint32_t priority = tree->nodes[node].priority;
+  int32_t* link = root_of(tree, order);
+  while (*link != NIL && tree->nodes[*link].priority > priority) {
+    struct extent_node* n = &tree->nodes[*link];
+    link = key < node_key(tree, *link, order) ? &n->left[order] : &n->right[order];
+  }
+  split(tree, order, *link, key, &tree->nodes[node].left[order], &tree->nodes[node].right[order]);
+  *link = node;
+}
+
+
+// takes node out of one order; its key must not have changed since insert()
+static void erase(struct extent_tree* tree, int order, int32_t node) {
+  int32_t* link = link_to(tree, order, node);
+  *link = merge(tree, order, tree->nodes[node].left[order], tree->nodes[node].right[order]);
+}
+
+
+// returns the node with the smallest key >= key, or NIL
+static int32_t lower_bound(const struct extent_tree* tree, int order, uint64_t key) {
+  int32_t found = NIL;
+  int32_t n = order == BY_START ? tree->by_start : tree->by_length;
+  while (n != NIL) {
+    if (node_key(tree, n, order) >= key) {
+      found = n;
+      n = tree->nodes[n].left[order];
+    } else {
+      n = tree->nodes[n].right[order];
+    }
+  }
+  return found;
+}
+
+
+// returns the extent with the largest start <= block, or NIL
+static int32_t extent_at_or_before(const struct extent_tree* tree, uint32_t block) {
+  int32_t found = NIL;
+  int32_t n = tree->by_start;
+  while (n != NIL) {
+    if (tree->nodes[n].start <= block) {
+      found = n;
+      n = tree->nodes[n].right[BY_START];
+    } else {
+      n = tree->nodes[n].left[BY_START];
+    }
+  }
+  return found;
+}
+
+
+// returns an unused node, or NIL if there are none left
+static int32_t new_node(struct extent_tree* tree, uint32_t start, uint32_t length) {
+  int32_t node = tree->free_node;
+  if (node == NIL) {
+    return NIL;
+  }
+  struct extent_node* n = &tree->nodes[node];
+  tree->free_node = n->left[BY_START];
+  // xorshift32
+  tree->seed ^= tree->seed << 13;
+  tree->seed ^= tree->seed >> 17;
+  tree->seed ^= tree->seed << 5;
+  n->priority = tree->seed;
+  n->start = start;
+  n->length = length;
+  tree->num_extents++;
+  return node;
+}
+
+
+static void delete_node(struct extent_tree* tree, int32_t node) {
+  erase(tree, BY_START, node);
+  erase(tree, BY_LENGTH, node);
+  tree->nodes[node].left[BY_START] = tree->free_node;
+  tree->free_node = node;
+  tree->num_extents--;
+}
+
+
+int extent_tree_init(struct extent_tree* tree, uint32_t max_extents) {
+  tree->nodes = malloc((max_extents > 0 ? max_extents : 1) * sizeof(struct extent_node));
+  if (tree->nodes == NULL) {
+    return -1;
+  }
+  tree->max_extents = max_extents;
+  tree->seed = 2463534242u;
+  extent_tree_clear(tree);
+  return 0;
+}
+
+
+void extent_tree_destroy(struct extent_tree* tree) {
+  free(tree->nodes);
+  tree->nodes = NULL;
+  tree->max_extents = 0;
+}
+
+
+void extent_tree_clear(struct extent_tree* tree) {
+  for (int32_t i = 0; i < tree->max_extents; i++) {
+    tree->nodes[i].left[BY_START] = i + 1 < tree->max_extents ? i + 1 : NIL;
+  }
+  tree->free_node = tree->max_extents > 0 ? 0 : NIL;
+  tree->by_start = NIL;
+  tree->by_length = NIL;
+  tree->num_extents = 0;
+  tree->num_free = 0;
+}
+
+
+int extent_tree_add(struct extent_tree* tree, uint32_t start, uint32_t length) {
+  if (length == 0) {
+    return 0;
+  }
+  uint64_t end = (uint64_t) start + length;
+  int32_t prev = extent_at_or_before(tree, start);
+  int32_t next = lower_bound(tree, BY_START, (uint64_t) start + 1);
+  if ((prev != NIL && (uint64_t) tree->nodes[prev].start + tree->nodes[prev].length > start) ||
+      (next != NIL && tree->nodes[next].start < end)) {
+    return -1; // (part of) the range is free already
+  }
+  int joins_prev = prev != NIL && tree->nodes[prev].start + tree->nodes[prev].length == start;
+  int joins_next = next != NIL && tree->nodes[next].start == end;
+
+  // extents only change length in place: they stay in the same place in
+  // start order, since they never overlap, but move in length order
+  if (joins_prev) {
+    erase(tree, BY_LENGTH, prev);
+    tree->nodes[prev].length += length;
+    if (joins_next) {
+      tree->nodes[prev].length += tree->nodes[next].length;
+      delete_node(tree, next);
+    }
+    insert(tree, BY_LENGTH, prev);
+  } else if (joins_next) {
+    erase(tree, BY_LENGTH, next);
+    tree->nodes[next].start = start;
+    tree->nodes[next].length += length;
+    insert(tree, BY_LENGTH, next);
+  } else {
+    int32_t node = new_node(tree, start, length);
+    if (node == NIL) {
+      return -1;
+    }
+    insert(tree, BY_START, node);
+    insert(tree, BY_LENGTH, node);
+  }
+  tree->num_free += length;
+  return 0;
+}
+
+
+int extent_tree_take(struct extent_tree* tree, uint32_t start, uint32_t length) {
+  if (length == 0) {
+    return 0;
+  }
+  int32_t node = extent_at_or_before(tree, start);
+  if (node == NIL) {
+    return -1;
+  }
+  struct extent_node* n = &tree->nodes[node];
+  uint64_t extent_end = (uint64_t) n->start + n->length;
+  uint64_t end = (uint64_t) start + length;
+  if (end > extent_end) {
+    return -1; // not all free
+  }
+  uint32_t before = start - n->start;
+  uint32_t after = extent_end - end;
+
+  if (before == 0 && after == 0) {
+    delete_node(tree, node);
+  } else if (before > 0 && after > 0) {
+    // the extent splits in two; the part after the range gets a new node
+    int32_t rest = new_node(tree, end, after);
+    if (rest == NIL) {
+      return -1;
+    }
+    n = &tree->nodes[node];
+    erase(tree, BY_LENGTH, node);
+    n->length = before;
+    insert(tree, BY_LENGTH, node);
+    insert(tree, BY_START, rest);
+    insert(tree, BY_LENGTH, rest);
+  } else {
+    erase(tree, BY_LENGTH, node);
+    if (before == 0) {
+      n->start = end;
+    }
+    n->length -= length;
+    insert(tree, BY_LENGTH, node);
+  }
+  tree->num_free -= length;
+  return 0;
+}
+
+
+int extent_tree_alloc(struct extent_tree* tree, uint32_t length, uint32_t* start) {
+  if (length == 0) {
+    return -1;
+  }
+  int32_t node = lower_bound(tree, BY_LENGTH, (uint64_t) length << 32);
+  if (node == NIL) {
+    return -1;
+  }
+  *start = tree->nodes[node].start;
+  return extent_tree_take(tree, *start, length);
+}
+
+
+int extent_tree_find(const struct extent_tree* tree, uint32_t from, struct free_extent* extent) {
+  int32_t node = extent_at_or_before(tree, from);
+  if (node == NIL || (uint64_t) tree->nodes[node].start + tree->nodes[node].length <= from) {
+    node = lower_bound(tree, BY_START, (uint64_t) from + 1);
+  }
+  if (node == NIL) {
+    return -1;
+  }
+  extent->start = tree->nodes[node].start;
+  extent->length = tree->nodes[node].length;
+  return 0;
+}
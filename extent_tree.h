@@ -0,0 +1,83 @@
+#ifndef _EXTENT_TREE_H_
+#define _EXTENT_TREE_H_
+
+#include <stdint.h>
+
+// A set of free extents (runs of consecutive free blocks), kept in two
+// treaps over the same nodes: one ordered by start, to find an extent's
+// neighbours (adjacent free extents are always merged into one), and one
+// ordered by length, then start, for best-fit allocation.  Every operation
+// takes O(log n) expected time in the number of extents.  The tree doesn't
+// know about blocks that are in use; it only covers the free ones, so the
+// caller allocates by taking ranges out of it and frees by adding them back.
+
+struct free_extent {
+  uint32_t start;
+  uint32_t length;
+};
+
+struct extent_node; // private to extent_tree.c
+
+struct extent_tree {
+  struct extent_node* nodes; // pool of max_extents nodes
+  int32_t max_extents;
+  int32_t free_node;         // first unused node of the pool, or -1
+  int32_t by_start;          // root of the treap ordered by start, or -1
+  int32_t by_length;         // root of the treap ordered by (length, start), or -1
+  uint32_t seed;             // for node priorities
+  uint32_t num_extents;
+  uint64_t num_free;         // total length of the extents
+};
+
+/* extent_tree_init
+ *   initializes an empty tree
+ * tree - the tree (allocated by the caller)
+ * max_extents - most extents the tree must hold at once; for a space of n
+ *   blocks, (n + 1) / 2 is always enough
+ * returns 0 on success or -1 if memory for the nodes can't be allocated
+ */
+int extent_tree_init(struct extent_tree* tree, uint32_t max_extents);
+
+/* extent_tree_destroy
+ *   frees the memory of a tree initialized with extent_tree_init()
+ */
+void extent_tree_destroy(struct extent_tree* tree);
+
+/* extent_tree_clear
+ *   removes every extent from a tree
+ */
+void extent_tree_clear(struct extent_tree* tree);
+
+/* extent_tree_add
+ *   adds a free range, merging it with the extents just before and after it
+ * start, length - the range; it must not overlap any extent already in the
+ *   tree
+ * returns 0 on success or -1 if the range overlaps an extent (a double free)
+ *   or the tree is full
+ */
+int extent_tree_add(struct extent_tree* tree, uint32_t start, uint32_t length);
+
+/* extent_tree_take
+ *   removes a range from the free extent that holds it (splitting the extent
+ *   in two if the range is in the middle of it)
+ * start, length - the range; it must lie within a single extent
+ * returns 0 on success or -1 if the range isn't free or the tree is full
+ */
+int extent_tree_take(struct extent_tree* tree, uint32_t start, uint32_t length);
+
+/* extent_tree_alloc
+ *   takes length blocks from the start of the smallest extent that has room
+ *   for them (the lowest such extent if there are several of that length)
+ * start - set to the first block taken
+ * returns 0 on success or -1 if no extent is that long
+ */
+int extent_tree_alloc(struct extent_tree* tree, uint32_t length, uint32_t* start);
+
+/* extent_tree_find
+ *   finds the extent that holds from, or else the first one after it
+ * extent - set to the extent found
+ * returns 0 on success or -1 if there are no free blocks at or after from
+ */
+int extent_tree_find(const struct extent_tree* tree, uint32_t from, struct free_extent* extent);
+
+#endif // _EXTENT_TREE_H_
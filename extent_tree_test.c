@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "extent_tree.h"
+#include "basic_file_system.h"
+
+// Tests for extent_tree.c, and for how basic_file_system.c allocates from it.
+// Run with `make test`; prints each failed check and exits with 1 if any did.
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+
+// checks that the tree holds exactly the extents in expected (in start order)
+static void check_extents(const struct extent_tree* tree, const struct free_extent* expected, uint32_t count) {
+  struct free_extent extent;
+  uint32_t from = 0;
+  uint32_t i = 0;
+  while (extent_tree_find(tree, from, &extent) == 0) {
+    CHECK(i < count);
+    if (i < count) {
+      CHECK(extent.start == expected[i].start && extent.length == expected[i].length);
+    }
+    from = extent.start + extent.length;
+    i++;
+  }
+  CHECK(i == count);
+  CHECK(tree->num_extents == count);
+}
+
+
+static void test_find_wraps() {
+  struct extent_tree tree;
+  CHECK(extent_tree_init(&tree, 8) == 0);
+  CHECK(extent_tree_add(&tree, 10, 5) == 0);
+  struct free_extent extent;
+  // inside, before and after the only extent
+  CHECK(extent_tree_find(&tree, 12, &extent) == 0 && extent.start == 10 && extent.length == 5);
+  CHECK(extent_tree_find(&tree, 3, &extent) == 0 && extent.start == 10);
+  CHECK(extent_tree_find(&tree, 15, &extent) < 0);
+  // nothing at or after 20, so callers wrap around to 0
+  CHECK(extent_tree_find(&tree, 20, &extent) < 0);
+  CHECK(extent_tree_find(&tree, 0, &extent) == 0 && extent.start == 10);
+  extent_tree_destroy(&tree);
+}
+
+
+static void test_take_splits() {
+  struct extent_tree tree;
+  CHECK(extent_tree_init(&tree, 8) == 0);
+  CHECK(extent_tree_add(&tree, 0, 100) == 0);
+  // from the middle: splits in two
+  CHECK(extent_tree_take(&tree, 40, 10) == 0);
+  struct free_extent split[] = { { 0, 40 }, { 50, 50 } };
+  check_extents(&tree, split, 2);
+  // from either end: shrinks
+  CHECK(extent_tree_take(&tree, 0, 5) == 0);
+  CHECK(extent_tree_take(&tree, 90, 10) == 0);
+  struct free_extent shrunk[] = { { 5, 35 }, { 50, 40 } };
+  check_extents(&tree, shrunk, 2);
+  // all of one
+  CHECK(extent_tree_take(&tree, 5, 35) == 0);
+  struct free_extent taken[] = { { 50, 40 } };
+  check_extents(&tree, taken, 1);
+  // ranges that aren't (all) free
+  CHECK(extent_tree_take(&tree, 45, 1) < 0);
+  CHECK(extent_tree_take(&tree, 45, 10) < 0);
+  CHECK(extent_tree_take(&tree, 85, 10) < 0);
+  check_extents(&tree, taken, 1);
+  CHECK(tree.num_free == 40);
+  extent_tree_destroy(&tree);
+}
+
+
+static void test_add_coalesces() {
+  struct extent_tree tree;
+  CHECK(extent_tree_init(&tree, 8) == 0);
+  CHECK(extent_tree_add(&tree, 10, 5) == 0);
+  CHECK(extent_tree_add(&tree, 30, 5) == 0);
+  // joins the one before, then the one after, then both
+  CHECK(extent_tree_add(&tree, 15, 2) == 0);
+  CHECK(extent_tree_add(&tree, 25, 5) == 0);
+  struct free_extent apart[] = { { 10, 7 }, { 25, 10 } };
+  check_extents(&tree, apart, 2);
+  CHECK(extent_tree_add(&tree, 17, 8) == 0);
+  struct free_extent joined[] = { { 10, 25 } };
+  check_extents(&tree, joined, 1);
+  // overlaps (double frees) are refused
+  CHECK(extent_tree_add(&tree, 5, 6) < 0);
+  CHECK(extent_tree_add(&tree, 34, 2) < 0);
+  CHECK(extent_tree_add(&tree, 20, 1) < 0);
+  check_extents(&tree, joined, 1);
+  CHECK(tree.num_free == 25);
+  extent_tree_destroy(&tree);
+}
+
+
+static void test_alloc_best_fit() {
+  struct extent_tree tree;
+  CHECK(extent_tree_init(&tree, 8) == 0);
+  CHECK(extent_tree_add(&tree, 0, 10) == 0);
+  CHECK(extent_tree_add(&tree, 20, 3) == 0);
+  CHECK(extent_tree_add(&tree, 30, 5) == 0);
+  CHECK(extent_tree_add(&tree, 40, 5) == 0);
+  uint32_t start;
+  CHECK(extent_tree_alloc(&tree, 4, &start) == 0 && start == 30); // the lowest of the two 5s
+  CHECK(extent_tree_alloc(&tree, 3, &start) == 0 && start == 20);
+  CHECK(extent_tree_alloc(&tree, 6, &start) == 0 && start == 0);
+  CHECK(extent_tree_alloc(&tree, 11, &start) < 0);
+  struct free_extent left[] = { { 6, 4 }, { 34, 1 }, { 40, 5 } };
+  check_extents(&tree, left, 3);
+  extent_tree_destroy(&tree);
+}
+
+
+// random adds, takes and allocations, checked against a plain array
+static void test_random() {
+  enum { SPACE = 2000 };
+  static unsigned char is_free[SPACE];
+  struct extent_tree tree;
+  CHECK(extent_tree_init(&tree, (SPACE + 1) / 2) == 0);
+  srand(1);
+  for (int i = 0; i < 50000 && failures == 0; i++) {
+    uint32_t start = rand() % SPACE;
+    uint32_t length = 1 + rand() % 16;
+    if (start + length > SPACE) {
+      length = SPACE - start;
+    }
+    int all_free = 1, none_free = 1;
+    for (uint32_t block = start; block < start + length; block++) {
+      all_free &= is_free[block];
+      none_free &= !is_free[block];
+    }
+    switch (rand() % 3) {
+    case 0:
+      CHECK((extent_tree_add(&tree, start, length) == 0) == none_free);
+      if (none_free) {
+        memset(is_free + start, 1, length);
+      }
+      break;
+    case 1:
+      CHECK((extent_tree_take(&tree, start, length) == 0) == all_free);
+      if (all_free) {
+        memset(is_free + start, 0, length);
+      }
+      break;
+    default:
+      if (extent_tree_alloc(&tree, length, &start) == 0) {
+        for (uint32_t block = start; block < start + length; block++) {
+          CHECK(is_free[block]);
+          is_free[block] = 0;
+        }
+      }
+    }
+  }
+  // the extents are exactly the free runs, coalesced
+  struct free_extent extent;
+  uint32_t from = 0, num_free = 0;
+  unsigned char seen[SPACE];
+  memset(seen, 0, sizeof(seen));
+  while (extent_tree_find(&tree, from, &extent) == 0) {
+    CHECK(extent.start == 0 || !is_free[extent.start - 1]);
+    memset(seen + extent.start, 1, extent.length);
+    num_free += extent.length;
+    from = extent.start + extent.length;
+  }
+  CHECK(memcmp(seen, is_free, SPACE) == 0);
+  CHECK(tree.num_free == num_free);
+  extent_tree_destroy(&tree);
+}
+
+
+// allocating near a goal past the last free block wraps around to the first
+static void test_bfs_wraps_around() {
+  char dir[] = "/tmp/extent_tree_test.XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    failures++;
+    return;
+  }
+  char image[sizeof(dir) + 8];
+  snprintf(image, sizeof(image), "%s/DISK", dir);
+  CHECK(bfs_mount(image) == 0);
+  CHECK(bfs_use_extent_tree() >= 0);
+  while (allocate_block() != 0) {
+  }
+  CHECK(count_free_blocks() == 0);
+  CHECK(release_block(5) == 0);
+  CHECK(allocate_block_near(NUM_BLOCKS - 10) == 5);
+  CHECK(allocate_block_near(NUM_BLOCKS - 10) == 0); // full again
+  // a run too long for any extent
+  CHECK(release_blocks((block_num_t[]) { 100, 102 }, 2) == 0);
+  CHECK(allocate_contiguous(2, 0) == 0);
+  CHECK(release_block(101) == 0);
+  CHECK(allocate_contiguous(3, 0) == 100);
+  // runs come from the first extent at or after the goal, not the best fit
+  CHECK(release_blocks((block_num_t[]) { 200, 201, 202, 203, 300, 301 }, 6) == 0);
+  CHECK(allocate_contiguous(2, 150) == 200);
+  CHECK(allocate_contiguous(2, 250) == 300);
+  CHECK(allocate_contiguous(2, 400) == 202); // wraps around
+  bfs_unmount();
+  unlink(image);
+  rmdir(dir);
+}
+
+
+int main() {
+  test_find_wraps();
+  test_take_splits();
+  test_add_coalesces();
+  test_alloc_best_fit();
+  test_random();
+  test_bfs_wraps_around();
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all extent tree tests passed\n");
+  return 0;
+}
@@ -0,0 +1,116 @@
+#include "jfs_trace.h"
+#include "jumbo_file_system.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// the trace being written, or NULL when tracing is off
+static FILE* trace_file = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t last_start_ns; // start of the last call written
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* jfs_trace_start
+ *   starts recording every jfs_* call (see jfs_trace.h for the format) to a
+ *   file on the _real_ file system, replacing any trace already in progress;
+ *   jfs_import/jfs_export are not recorded, and jfs_async_* requests are
+ *   recorded as the synchronous calls the workers make
+ * path - the file to write the trace to
+ * returns 0 on success or -1 if the file can't be created
+ */
+int jfs_trace_start(const char* path) {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    return -1;
+  }
+  struct trace_header header;
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  fwrite(&header, sizeof(header), 1, file);
+
+  jfs_trace_stop();
+  pthread_mutex_lock(&trace_lock);
+  last_start_ns = now_ns();
+  __atomic_store_n(&trace_file, file, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&trace_lock);
+  return 0;
+}
+
+/* jfs_trace_stop
+ *   stops recording and closes the trace file, if tracing is on
+ * returns 0 on success or -1 if the trace could not be written completely
+ */
+int jfs_trace_stop() {
+  pthread_mutex_lock(&trace_lock);
+  FILE* file = trace_file;
+  __atomic_store_n(&trace_file, NULL, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&trace_lock);
+  if (file == NULL) {
+    return 0;
+  }
+  int failed = ferror(file);
+  return (fclose(file) != 0 || failed) ? -1 : 0;
+}
+
+void trace_begin(struct trace_call* call, int op, const char* name, const char* name2, unsigned short count) {
+  // tracing off costs a single load
+  if (__atomic_load_n(&trace_file, __ATOMIC_ACQUIRE) == NULL) {
+    call->op = 0;
+    return;
+  }
+  call->op = op;
+  call->name = name;
+  call->name2 = name2;
+  call->count = count;
+  call->start_ns = now_ns();
+}
+
+void trace_end(struct trace_call* call) {
+  if (call->op == 0) {
+    return;
+  }
+  uint64_t end_ns = now_ns();
+  struct trace_record record;
+  record.duration_us = (end_ns - call->start_ns) / 1000;
+  record.count = call->count;
+  record.op = call->op;
+  record.flags = 0;
+  size_t name_len = 0;
+  size_t name2_len = 0;
+  if (call->name == NULL) {
+    record.name_len = TRACE_NULL_NAME;
+  } else {
+    // (with two names, each gets half the room)
+    size_t max_len = call->name2 == NULL ? TRACE_NULL_NAME - 1 : (TRACE_NULL_NAME - 2) / 2;
+    name_len = strnlen(call->name, max_len + 1);
+    if (call->name2 != NULL) {
+      name2_len = strnlen(call->name2, max_len + 1);
+    }
+    if (name_len > max_len || name2_len > max_len) {
+      record.flags |= TRACE_TRUNCATED;
+      name_len = name_len > max_len ? max_len : name_len;
+      name2_len = name2_len > max_len ? max_len : name2_len;
+    }
+    record.name_len = name_len + (call->name2 != NULL ? 1 + name2_len : 0);
+  }
+
+  pthread_mutex_lock(&trace_lock);
+  // tracing may have stopped (or restarted) while the call ran
+  if (trace_file != NULL) {
+    record.start_delta_us = ((int64_t) call->start_ns - (int64_t) last_start_ns) / 1000;
+    last_start_ns = call->start_ns;
+    fwrite(&record, sizeof(record), 1, trace_file);
+    fwrite(call->name, 1, name_len, trace_file);
+    if (call->name2 != NULL) {
+      fputc('\0', trace_file);
+      fwrite(call->name2, 1, name2_len, trace_file);
+    }
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,64 @@
+#ifndef _JFS_TRACE_H_
+#define _JFS_TRACE_H_
+
+#include <stdint.h>
+
+/* Trace files written by jfs_trace_start() and read by the replay program.
+ *
+ * A trace is a struct trace_header followed by one struct trace_record per
+ * jfs_* call, in the order the calls finished.  Each record is followed by
+ * name_len bytes of the call's name argument (not NUL-terminated); calls with
+ * two names (jfs_rename) store both, separated by a NUL.  Names too long to
+ * fit are cut short, and the record is marked TRACE_TRUNCATED.  All fields
+ * are stored in the host's byte order.
+ */
+
+#define TRACE_MAGIC "JFST"
+#define TRACE_VERSION 3
+
+// name_len of a call whose name argument was NULL
+#define TRACE_NULL_NAME 0xff
+
+// trace_record flags
+#define TRACE_TRUNCATED 0x01 // a name was cut short, so the call can't be replayed
+
+struct trace_header {
+  char magic[4];     // TRACE_MAGIC
+  uint32_t version;  // TRACE_VERSION
+} __attribute__((packed));
+
+struct trace_record {
+  int64_t start_delta_us; // start time relative to the start of the previous record
+                          // (negative if calls on other threads overlapped)
+  uint32_t duration_us;   // time the call took, including waiting for the fs lock
+  uint16_t count;         // bytes written, or buffer size for jfs_read
+  uint8_t op;             // JFS_OP_*
+  uint8_t name_len;       // length of the name that follows, or TRACE_NULL_NAME
+  uint8_t flags;          // TRACE_* flags
+} __attribute__((packed));
+
+// A jfs_* call in progress; see TRACE_CALL
+struct trace_call {
+  uint64_t start_ns;
+  const char* name;
+  const char* name2; // second name, or NULL
+  uint16_t count;
+  uint8_t op; // 0 if tracing is off
+};
+
+void trace_begin(struct trace_call* call, int op, const char* name, const char* name2, unsigned short count);
+void trace_end(struct trace_call* call);
+
+// Records the jfs_* call that contains it (when tracing is on); the record is
+// written when the enclosing scope exits.  Put it before LOCK_FS_* so the
+// time spent waiting for the lock is part of the recorded duration.
+#define TRACE_CALL(op, name, count) \
+    struct trace_call trace_call __attribute__((cleanup(trace_end))); \
+    trace_begin(&trace_call, op, name, NULL, count)
+
+// same, for calls that take two names
+#define TRACE_CALL_2(op, name, name2) \
+    struct trace_call trace_call __attribute__((cleanup(trace_end))); \
+    trace_begin(&trace_call, op, name, name2, 0)
+
+#endif // _JFS_TRACE_H_
@@ -1,22 +1,308 @@
 #include "jumbo_file_system.h"
+#include "jfs_trace.h"
+#include "crc32c.h"
 #include <string.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
 
 // C does not have a bool type, so I created one that you can use
 typedef char bool_t;
 #define TRUE 1
 #define FALSE 0
 
-static block_num_t current_dir;
+// blocks of the directories from the root directory (path[0]) down to a
+// working directory (path[depth])
+struct working_dir {
+    block_num_t path[MAX_DIR_DEPTH+1];
+    int depth;
+};
+
+// jfs_* functions work in the current directory, except while a worker
+// thread runs an asynchronous operation: then op_dir points to a copy of the
+// current directory as it was when the operation was submitted
+static struct working_dir cwd;
+static __thread struct working_dir* op_dir;
+#define dir_path ((op_dir ? op_dir : &cwd)->path)
+#define dir_depth ((op_dir ? op_dir : &cwd)->depth)
+#define current_dir (dir_path[dir_depth])
+
+// Every jfs_* function holds fs_lock while it runs: shared by the ones that
+// only read the file system, exclusive by the ones that change it (or the
+// current directory).  LOCK_FS_* takes the lock until the end of the scope.
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// JFS_DURABILITY_* policy of the current mount
+static int durability = JFS_DURABILITY_NONE;
+
+static void unlock_fs(pthread_rwlock_t** lock) {
+    pthread_rwlock_unlock(*lock);
+}
+// the functions that change the file system end here, so this is where
+// JFS_DURABILITY_SYNC flushes their changes (a failed flush is retried, and
+// reported, by the next jfs_sync())
+static void unlock_fs_exclusive(pthread_rwlock_t** lock) {
+    if(durability==JFS_DURABILITY_SYNC){
+      raw_sync();
+    }
+    pthread_rwlock_unlock(*lock);
+}
+#define LOCK_FS_SHARED() \
+    pthread_rwlock_t* fs_lock_held __attribute__((cleanup(unlock_fs))) = \
+        (pthread_rwlock_rdlock(&fs_lock), &fs_lock)
+#define LOCK_FS_EXCLUSIVE() \
+    pthread_rwlock_t* fs_lock_held __attribute__((cleanup(unlock_fs_exclusive))) = \
+        (pthread_rwlock_wrlock(&fs_lock), &fs_lock)
+
+// With JFS_DURABILITY_PERIODIC, a background thread flushes the disk every
+// interval_ms (raw_sync() does nothing if nothing was written meanwhile)
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // signalled to stop the thread
+    int running;
+    int shutdown;
+    int interval_ms;
+    pthread_t thread;
+} flusher = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0 };
+
+static void* flush_worker(void* arg){
+    (void) arg;
+    pthread_mutex_lock(&flusher.lock);
+    while(!flusher.shutdown){
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += flusher.interval_ms/1000;
+      deadline.tv_nsec += (flusher.interval_ms%1000)*1000000L;
+      if(deadline.tv_nsec>=1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      if(pthread_cond_timedwait(&flusher.wake, &flusher.lock, &deadline)!=0 && !flusher.shutdown){
+        pthread_mutex_unlock(&flusher.lock);
+        raw_sync();
+        pthread_mutex_lock(&flusher.lock);
+      }
+    }
+    pthread_mutex_unlock(&flusher.lock);
+    return NULL;
+}
+
+static void start_flusher(int interval_ms){
+    flusher.interval_ms = interval_ms>0 ? interval_ms : DEFAULT_FLUSH_INTERVAL_MS;
+    flusher.shutdown = 0;
+    flusher.running = pthread_create(&flusher.thread, NULL, flush_worker, NULL)==0;
+}
+
+static void stop_flusher(){
+    if(!flusher.running){
+      return;
+    }
+    pthread_mutex_lock(&flusher.lock);
+    flusher.shutdown = 1;
+    pthread_cond_signal(&flusher.wake);
+    pthread_mutex_unlock(&flusher.lock);
+    pthread_join(flusher.thread, NULL);
+    flusher.running = 0;
+}
+
+// size of the jfs_async_* worker pool, and the eventfd that signals completions
+static int async_pool_size = DEFAULT_ASYNC_WORKERS;
+static int async_event_fd = -1;
+
+// With JFS_MOUNT_METADATA_CACHE, every directory block and inode is loaded
+// into memory at mount (meta_nodes, indexed by block number), so lookups,
+// stat, ls and chdir are served without touching the disk.  A node holds a
+// copy of its block, which every write of the block updates (all writes go
+// through write_jfs_block/write_jfs_blocks), so reads of the block can be
+// served from the copy.  Directories also get a hash index of their entries
+// by name, and inodes a list of their extents.  Nodes are only changed with
+// fs_lock held exclusively.
+#define META_HASH_SLOTS 8 // a power of 2 larger than MAX_DIR_ENTRIES
+struct meta_extent {
+    block_num_t start;
+    uint16_t length;
+};
+struct meta_node {
+    struct block block;
+    int8_t name_slots[META_HASH_SLOTS];          // directories: entry index, or -1 if the slot is empty
+    struct meta_extent extents[MAX_DATA_BLOCKS]; // files: runs of consecutive data blocks
+    int num_extents;
+};
+static bool_t meta_enabled;
+static struct meta_node* meta_nodes[NUM_BLOCKS];
+
+int count_num_data_block(uint32_t file_size);
+
+static uint32_t name_hash(const char* name){
+    uint32_t hash = 2166136261u; // FNV-1a
+    for(int i=0; i<=MAX_NAME_LENGTH && name[i]!='\0'; i++){
+      hash = (hash^(unsigned char)name[i])*16777619u;
+    }
+    return hash;
+}
+
+// rebuilds a node's name index or extent list after its block changed
+static void meta_index(struct meta_node* node){
+    const struct block* block = &node->block;
+    memset(node->name_slots, -1, sizeof(node->name_slots));
+    node->num_extents = 0;
+    if(block->is_dir==0){ // it is a directory
+      for(int i=0; i<block->contents.dirnode.num_entries && i<(int)MAX_DIR_ENTRIES; i++){
+        int slot = name_hash(block->contents.dirnode.entries[i].name) & (META_HASH_SLOTS-1);
+        while(node->name_slots[slot]>=0){
+          slot = (slot+1) & (META_HASH_SLOTS-1);
+        }
+        node->name_slots[slot] = i;
+      }
+    }
+    else{ // it is a file
+      int num_data_blocks = count_num_data_block(block->contents.inode.file_size);
+      for(int i=0; i<num_data_blocks && i<(int)MAX_DATA_BLOCKS; i++){
+        block_num_t data_block = block->contents.inode.data_blocks[i];
+        struct meta_extent* last = node->num_extents>0 ? &node->extents[node->num_extents-1] : NULL;
+        if(last!=NULL && last->start+last->length==data_block){
+          last->length++;
+        }
+        else{
+          node->extents[node->num_extents].start = data_block;
+          node->extents[node->num_extents].length = 1;
+          node->num_extents++;
+        }
+      }
+    }
+}
+
+static void meta_unload();
+
+// adds (or refreshes) the node of a directory block or inode
+static void meta_insert(block_num_t block_num, const void* block){
+    if(!meta_enabled){
+      return;
+    }
+    if(meta_nodes[block_num]==NULL){
+      meta_nodes[block_num] = malloc(sizeof(struct meta_node));
+      if(meta_nodes[block_num]==NULL){
+        // out of memory: go on without the cache (every block is on disk)
+        meta_unload();
+        meta_enabled = FALSE;
+        return;
+      }
+    }
+    memcpy(&meta_nodes[block_num]->block, block, sizeof(struct block));
+    meta_index(meta_nodes[block_num]);
+}
+
+// forgets a block that is no longer a directory block or inode
+static void meta_drop(block_num_t block_num){
+    free(meta_nodes[block_num]);
+    meta_nodes[block_num] = NULL;
+}
+
+// loads a directory and everything below it into memory
+static void meta_load_tree(block_num_t block_num){
+    struct block diskBlock;
+    if(read_block(block_num, &diskBlock)<0){
+      return; // damaged blocks are left to be read (and reported) from disk
+    }
+    meta_insert(block_num, &diskBlock);
+    if(diskBlock.is_dir==0){ // it is a directory
+      for(int i=0; i<diskBlock.contents.dirnode.num_entries; i++){
+        meta_load_tree(diskBlock.contents.dirnode.entries[i].block_num);
+      }
+    }
+}
+
+static void meta_unload(){
+    for(int i=0; i<NUM_BLOCKS; i++){
+      meta_drop(i);
+    }
+}
+
+// looks up a name in a directory's node
+// returns the entry's index, or -1 if there is no such entry
+static int meta_find_entry(const struct meta_node* node, const char* name){
+    int slot = name_hash(name) & (META_HASH_SLOTS-1);
+    for(int probes=0; probes<META_HASH_SLOTS && node->name_slots[slot]>=0; probes++){
+      int i = node->name_slots[slot];
+      if(!strncmp(node->block.contents.dirnode.entries[i].name, name, MAX_NAME_LENGTH+1)){
+        return i;
+      }
+      slot = (slot+1) & (META_HASH_SLOTS-1);
+    }
+    return -1;
+}
+
+// writes a block, keeping its in-memory copy (if it has one) up to date; if
+// the write fails, the copy is dropped, so that the block is read back (and
+// any damage reported) from disk
+static int write_jfs_block(block_num_t block_num, void* buf) {
+    int ret = write_block(block_num, buf);
+    if(meta_nodes[block_num]!=NULL){
+      if(ret<0){
+        meta_drop(block_num);
+      }
+      else{
+        meta_insert(block_num, buf);
+      }
+    }
+    return ret;
+}
+
+static int write_jfs_blocks(const block_num_t* blocks, int count, const void* buf) {
+    int ret = write_blocks(blocks, count, buf);
+    for(int i=0; i<count; i++){
+      if(meta_nodes[blocks[i]]!=NULL){
+        if(ret<0){ // (some of the blocks may have been written)
+          meta_drop(blocks[i]);
+        }
+        else{
+          meta_insert(blocks[i], (const char*)buf+i*BLOCK_SIZE);
+        }
+      }
+    }
+    return ret;
+}
+
+// reads a block and converts raw disk failures into jfs_* error codes
+static int read_jfs_block(block_num_t block_num, void* buf) {
+    if(meta_nodes[block_num]!=NULL){
+      memcpy(buf, &meta_nodes[block_num]->block, BLOCK_SIZE);
+      return 0;
+    }
+    int ret = read_block(block_num, buf);
+    if(ret==RAW_E_CHECKSUM){
+      return E_CHECKSUM;
+    }
+    else if(ret<0){
+      return E_UNKNOWN;
+    }
+    return 0;
+}
 
 // optional helper function you can implement to tell you if a block is a dir node or an inode
-static bool_t is_dir(block_num_t block_num) {
+// returns TRUE for a dir node, FALSE for an inode, or the error reading the block
+static int is_dir(block_num_t block_num) {
+    if(meta_nodes[block_num]!=NULL){
+      return meta_nodes[block_num]->block.is_dir==0;
+    }
     char *buffer = malloc(BLOCK_SIZE);
     struct block *diskBlock = malloc(sizeof(struct block));
     bzero(buffer, BLOCK_SIZE);
     bzero(diskBlock, sizeof(struct block));
-    read_block(block_num, buffer);
+    int ret = read_jfs_block(block_num, buffer);
+    if(ret<0){
+      free(buffer);
+      free(diskBlock);
+      return ret;
+    }
     memcpy(diskBlock, buffer, sizeof(struct block));
     if(diskBlock->is_dir==0){
       free(buffer);
@@ -30,12 +316,33 @@ static bool_t is_dir(block_num_t block_num) {
     }
 }
 
-static bool_t is_empty_dir(block_num_t block_num){
+// whether entry i of a directory block is a subdirectory (or a regular file)
+static bool_t entry_is_dir(const struct block* dirBlock, int i){
+    return (dirBlock->contents.dirnode.entry_types >> i) & 1;
+}
+
+static void set_entry_type(struct block* dirBlock, int i, bool_t is_dir){
+    if(is_dir){
+      dirBlock->contents.dirnode.entry_types |= 1 << i;
+    }
+    else{
+      dirBlock->contents.dirnode.entry_types &= ~(1 << i);
+    }
+}
+
+// returns TRUE if a directory has no entries, FALSE if it has some, or the
+// error reading its block
+static int is_empty_dir(block_num_t block_num){
     char *buffer = malloc(BLOCK_SIZE);
     struct block *diskBlock = malloc(sizeof(struct block));
     bzero(buffer, BLOCK_SIZE);
     bzero(diskBlock, sizeof(struct block));
-    read_block(block_num, buffer);
+    int ret = read_jfs_block(block_num, buffer);
+    if(ret<0){
+      free(buffer);
+      free(diskBlock);
+      return ret;
+    }
     memcpy(diskBlock, buffer, sizeof(struct block));
     if(diskBlock->contents.dirnode.num_entries==0){
       free(buffer);
@@ -49,6 +356,143 @@ static bool_t is_empty_dir(block_num_t block_num){
     }
 }
 
+// In dedup mode, full data blocks are indexed by their CRC32C fingerprint so
+// that writing identical content shares the existing block instead of
+// allocating a new one.  The index lives in memory and is rebuilt at mount;
+// the reference counts it relies on are kept on disk by the bfs layer.
+#define DEDUP_BUCKETS 256
+static bool_t dedup_enabled;
+static block_num_t dedup_buckets[DEDUP_BUCKETS]; // first indexed block of each bucket (0 if none)
+static block_num_t dedup_next[NUM_BLOCKS];       // next indexed block in the same bucket
+static uint32_t dedup_hash[NUM_BLOCKS];          // fingerprint of each indexed block
+static bool_t dedup_indexed[NUM_BLOCKS];
+
+static void dedup_insert(block_num_t block_num, const void* data){
+    if(dedup_indexed[block_num]){
+      return;
+    }
+    uint32_t hash = crc32c(0, data, BLOCK_SIZE);
+    dedup_hash[block_num] = hash;
+    dedup_next[block_num] = dedup_buckets[hash % DEDUP_BUCKETS];
+    dedup_buckets[hash % DEDUP_BUCKETS] = block_num;
+    dedup_indexed[block_num] = TRUE;
+}
+
+static void dedup_remove(block_num_t block_num){
+    if(!dedup_indexed[block_num]){
+      return;
+    }
+    block_num_t *link = &dedup_buckets[dedup_hash[block_num] % DEDUP_BUCKETS];
+    while(*link!=block_num){
+      link = &dedup_next[*link];
+    }
+    *link = dedup_next[block_num];
+    dedup_indexed[block_num] = FALSE;
+}
+
+// returns an indexed block holding exactly the same BLOCK_SIZE bytes as data, or 0
+// pending, pending_data - blocks indexed by the caller that aren't written
+//   yet, and their contents (num_pending blocks of BLOCK_SIZE bytes)
+static block_num_t dedup_find(const void* data, const block_num_t* pending, int num_pending,
+                              const char* pending_data){
+    uint32_t hash = crc32c(0, data, BLOCK_SIZE);
+    char candidate[BLOCK_SIZE];
+    for(block_num_t b=dedup_buckets[hash % DEDUP_BUCKETS]; b!=0; b=dedup_next[b]){
+      if(dedup_hash[b]!=hash){
+        continue;
+      }
+      // fingerprints can collide, so compare the actual contents too
+      const char *contents = NULL;
+      for(int i=0; i<num_pending && contents==NULL; i++){
+        if(pending[i]==b){
+          contents = pending_data+i*BLOCK_SIZE;
+        }
+      }
+      if(contents==NULL && read_block(b, candidate)==0){
+        contents = candidate;
+      }
+      if(contents!=NULL && !memcmp(contents, data, BLOCK_SIZE)){
+        return b;
+      }
+    }
+    return 0;
+}
+
+// adds the full data blocks of every file under block_num to the dedup index
+static void dedup_index_tree(block_num_t block_num){
+    struct block diskBlock;
+    if(read_block(block_num, &diskBlock)<0){
+      return;
+    }
+    if(diskBlock.is_dir==1){ // it is a file
+      char data[BLOCK_SIZE];
+      for(uint32_t i=0; i<diskBlock.contents.inode.file_size/BLOCK_SIZE; i++){
+        block_num_t data_block = diskBlock.contents.inode.data_blocks[i];
+        if(!dedup_indexed[data_block] && read_block(data_block, data)==0){
+          dedup_insert(data_block, data);
+        }
+      }
+    }
+    else{ // it is a directory
+      for(int i=0; i<diskBlock.contents.dirnode.num_entries; i++){
+        dedup_index_tree(diskBlock.contents.dirnode.entries[i].block_num);
+      }
+    }
+}
+
+// releases one reference to a file data block, dropping it from the dedup
+// index when the block is actually freed
+static int release_data_block(block_num_t block_num){
+    int ret = release_block(block_num);
+    if(dedup_indexed[block_num] && block_ref_count(block_num)==0){
+      dedup_remove(block_num);
+    }
+    return ret;
+}
+
+// gives back the blocks a failed jfs_write() took: entries [from, to) of the
+// inode's data blocks and the copy of its partial block (if not 0)
+static void undo_append(const struct block* inode, int from, int to, block_num_t copy_num){
+    for(int i=from; i<to; i++){
+      release_data_block(inode->contents.inode.data_blocks[i]);
+    }
+    if(copy_num!=0){
+      release_block(copy_num);
+    }
+}
+
+// Readahead: jfs_read() prefetches a window of data blocks into the block
+// cache before it needs them, doubling the window each time it is used up.
+// The window a file reached is remembered, so repeated sequential scans of
+// the same file start out with large prefetches.
+#define READAHEAD_MIN_WINDOW 4
+#define READAHEAD_MAX_WINDOW 16
+#define READAHEAD_SLOTS 16
+static pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    block_num_t inode;
+    uint16_t window;
+} readahead_state[READAHEAD_SLOTS];
+
+static uint16_t readahead_window(block_num_t inode){
+    int slot = inode % READAHEAD_SLOTS;
+    uint16_t window = READAHEAD_MIN_WINDOW;
+    pthread_mutex_lock(&readahead_lock);
+    if(readahead_state[slot].inode==inode){
+      window = readahead_state[slot].window;
+    }
+    pthread_mutex_unlock(&readahead_lock);
+    return window;
+}
+
+static void save_readahead_window(block_num_t inode, uint16_t window){
+    int slot = inode % READAHEAD_SLOTS;
+    pthread_mutex_lock(&readahead_lock);
+    readahead_state[slot].inode = inode;
+    readahead_state[slot].window = window;
+    pthread_mutex_unlock(&readahead_lock);
+}
+
 int count_num_data_block(uint32_t file_size){
   if(file_size%BLOCK_SIZE==0){
     return file_size/BLOCK_SIZE;
@@ -58,34 +502,74 @@ int count_num_data_block(uint32_t file_size){
   }
 }
 
-int count_occupied_disk_size(int size, block_num_t block_num){
-    char *buffer = malloc(BLOCK_SIZE);
-    struct block *diskBlock = malloc(sizeof(struct block));
-    bzero(buffer, BLOCK_SIZE);
-    bzero(diskBlock, sizeof(struct block));
-    read_block(block_num, buffer);
-    memcpy(diskBlock, buffer, sizeof(struct block));
-    if(diskBlock->is_dir==1) // it is a file
-    {
-      size+= count_num_data_block(diskBlock->contents.inode.file_size)*BLOCK_SIZE; //size of data blocks
-    }
-    else{ // it is a directory
-      size+= diskBlock->contents.dirnode.num_entries*BLOCK_SIZE; //size of inode & directory blocks
-      for(int i=0; i<diskBlock->contents.dirnode.num_entries; i++){
-          size = count_occupied_disk_size(size, diskBlock->contents.dirnode.entries[i].block_num);
+// Every directory block records the number of blocks and bytes used below
+// it, so jfs_du() never has to walk the tree.  Operations keep the counters
+// of the current directory and all its ancestors up to date.
+static void update_path_counters(int depth, int blocks_delta, int bytes_delta);
+static void update_subtree_counters(int blocks_delta, int bytes_delta){
+    update_path_counters(dir_depth, blocks_delta, bytes_delta);
+}
+
+// same, for the directories dir_path[0] to dir_path[depth] only
+static void update_path_counters(int depth, int blocks_delta, int bytes_delta){
+    struct block dirBlock;
+    for(int i=0; i<=depth; i++){
+      if(read_jfs_block(dir_path[i], &dirBlock)<0){
+        continue;
       }
+      dirBlock.contents.dirnode.subtree_blocks += blocks_delta;
+      dirBlock.contents.dirnode.subtree_bytes += bytes_delta;
+      write_jfs_block(dir_path[i], &dirBlock);
     }
-    free(diskBlock);
-    free(buffer);
-    return size;
 }
 
-block_num_t find_block_num_by_name(const char* directory_name){
+// recomputes the subtree counters and entry types of a directory and
+// everything below it (only needed once, for images created before the
+// counters and entry types existed)
+static void rebuild_dir_metadata(block_num_t block_num, struct usage* total){
+    struct block diskBlock;
+    bzero(total, sizeof(struct usage));
+    if(read_jfs_block(block_num, &diskBlock)<0){
+      return;
+    }
+    if(diskBlock.is_dir==1){ // it is a file
+      total->num_blocks = count_num_data_block(diskBlock.contents.inode.file_size);
+      total->num_bytes = diskBlock.contents.inode.file_size;
+      return;
+    }
+    for(int i=0; i<diskBlock.contents.dirnode.num_entries; i++){
+      struct usage child;
+      block_num_t child_num = diskBlock.contents.dirnode.entries[i].block_num;
+      set_entry_type(&diskBlock, i, is_dir(child_num)>0); // (an unreadable child counts as a file)
+      rebuild_dir_metadata(child_num, &child);
+      total->num_blocks += 1+child.num_blocks;
+      total->num_bytes += child.num_bytes;
+    }
+    diskBlock.contents.dirnode.subtree_blocks = total->num_blocks;
+    diskBlock.contents.dirnode.subtree_bytes = total->num_bytes;
+    diskBlock.contents.dirnode.flags |= DIR_COUNTERS_VALID|DIR_TYPES_VALID;
+    write_jfs_block(block_num, &diskBlock);
+}
+
+// looks a name up in the current directory
+// returns its block number, 0 if there is no such entry, or the error reading
+// the directory block
+int find_block_num_by_name(const char* directory_name){
+    struct meta_node* node = meta_nodes[current_dir];
+    if(node!=NULL){
+      int i = meta_find_entry(node, directory_name);
+      return i<0 ? 0 : node->block.contents.dirnode.entries[i].block_num;
+    }
     char *buffer = malloc(BLOCK_SIZE);
     struct block *dirBlock = malloc(sizeof(struct block));
     bzero(buffer, BLOCK_SIZE);
     bzero(dirBlock, sizeof(struct block));
-    read_block(current_dir, buffer);
+    int ret = read_jfs_block(current_dir, buffer);
+    if(ret<0){
+      free(buffer);
+      free(dirBlock);
+      return ret;
+    }
     memcpy(dirBlock, buffer, sizeof(struct block));
     uint16_t num_entries = dirBlock->contents.dirnode.num_entries;
     for(int i=0; i<num_entries; i++){
@@ -101,12 +585,405 @@ block_num_t find_block_num_by_name(const char* directory_name){
     return 0; // fail to find such block, return 0 (which is the block number of superblock, so there will be no confusion)
 }
 
+// finds an entry of an in-memory directory block
+// returns its index, or -1 if there is no entry with this name
+static int find_entry(const struct block* dirBlock, const char* name){
+    for(int i=0; i<dirBlock->contents.dirnode.num_entries; i++){
+      if(!strncmp(dirBlock->contents.dirnode.entries[i].name, name, MAX_NAME_LENGTH+1)){
+        return i;
+      }
+    }
+    return -1;
+}
+
+// Paths.  Every jfs_* function that takes a name also takes a slash-separated
+// path, absolute (from the root) or relative (to the current directory), in
+// which "." and ".." may appear.  IN_PATH_DIR resolves the path and runs the
+// rest of the function in the directory holding its last component, by
+// pointing op_dir at it, so the rest of the code only ever deals with names
+// in the current directory.  Resolved directories are remembered in a small
+// cache, keyed by the block of the directory the walk started from and the
+// directory part of the path; anything that removes, moves or copies a
+// directory empties it (by moving on to a new generation).
+#define PATH_CACHE_SLOTS 64
+#define PATH_CACHE_KEY_LENGTH 48
+struct path_cache_entry {
+    unsigned generation; // the entry is valid while this is path_cache_generation
+    block_num_t start;   // directory the walk started from
+    uint8_t pops;        // levels the walk went up from start ("..")
+    uint8_t num_pushed;  // levels it then went down, through pushed[]
+    char key[PATH_CACHE_KEY_LENGTH]; // the directory part of the path
+    block_num_t pushed[MAX_DIR_DEPTH];
+};
+static pthread_mutex_t path_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct path_cache_entry path_cache[PATH_CACHE_SLOTS];
+static unsigned path_cache_generation = 1;
+
+static void path_cache_invalidate(){
+    pthread_mutex_lock(&path_cache_lock);
+    path_cache_generation++;
+    pthread_mutex_unlock(&path_cache_lock);
+}
+
+static struct path_cache_entry* path_cache_slot(block_num_t start, const char* key, size_t len){
+    uint32_t hash = 2166136261u ^ start; // FNV-1a
+    for(size_t i=0; i<len; i++){
+      hash = (hash^(unsigned char)key[i])*16777619u;
+    }
+    return &path_cache[hash % PATH_CACHE_SLOTS];
+}
+
+// walks the directories in path[0..len) from dir (updated in place)
+static int walk_dirs(const char* path, size_t len, struct working_dir* dir){
+    if(len==0){
+      return 0;
+    }
+    block_num_t start = dir->path[dir->depth];
+    int start_depth = dir->depth;
+    bool_t cacheable = len<PATH_CACHE_KEY_LENGTH;
+    if(cacheable){
+      pthread_mutex_lock(&path_cache_lock);
+      struct path_cache_entry* entry = path_cache_slot(start, path, len);
+      if(entry->generation==path_cache_generation && entry->start==start &&
+         !strncmp(entry->key, path, len) && entry->key[len]=='\0'){
+        dir->depth -= entry->pops;
+        memcpy(&dir->path[dir->depth+1], entry->pushed, entry->num_pushed*sizeof(block_num_t));
+        dir->depth += entry->num_pushed;
+        pthread_mutex_unlock(&path_cache_lock);
+        return 0;
+      }
+      pthread_mutex_unlock(&path_cache_lock);
+    }
+    int min_depth = dir->depth;
+    const char* end = path+len;
+    for(const char* p=path; p<end; ){
+      const char* slash = memchr(p, '/', end-p);
+      size_t n = (slash ? slash : end)-p;
+      if(n==2 && !strncmp(p, "..", 2)){
+        if(dir->depth>0){
+          dir->depth--;
+        }
+        if(dir->depth<min_depth){
+          min_depth = dir->depth;
+        }
+      }
+      else if(n>0 && !(n==1 && p[0]=='.')){
+        if(n>MAX_NAME_LENGTH){
+          return E_NOT_EXISTS;
+        }
+        char name[MAX_NAME_LENGTH+1];
+        memcpy(name, p, n);
+        name[n] = '\0';
+        struct block dirBlock;
+        int ret = read_jfs_block(dir->path[dir->depth], &dirBlock);
+        if(ret<0){
+          return ret;
+        }
+        int i = find_entry(&dirBlock, name);
+        if(i<0){
+          return E_NOT_EXISTS;
+        }
+        if(!entry_is_dir(&dirBlock, i)){
+          return E_NOT_DIR;
+        }
+        if(dir->depth==MAX_DIR_DEPTH){
+          return E_MAX_DIR_DEPTH;
+        }
+        dir->path[++dir->depth] = dirBlock.contents.dirnode.entries[i].block_num;
+      }
+      p += n+1;
+    }
+    if(cacheable){
+      pthread_mutex_lock(&path_cache_lock);
+      struct path_cache_entry* entry = path_cache_slot(start, path, len);
+      entry->generation = path_cache_generation;
+      entry->start = start;
+      entry->pops = start_depth-min_depth;
+      entry->num_pushed = dir->depth-min_depth;
+      bzero(entry->key, sizeof(entry->key));
+      memcpy(entry->key, path, len);
+      memcpy(entry->pushed, &dir->path[min_depth+1], entry->num_pushed*sizeof(block_num_t));
+      pthread_mutex_unlock(&path_cache_lock);
+    }
+    return 0;
+}
+
+// resolves every component of path but the last into dir, and copies the
+// last one into name (MAX_NAME_LENGTH+2 bytes; longer names are cut to
+// MAX_NAME_LENGTH+1 characters, so they still fail as too long); name is
+// left empty if the path names a directory itself ("/", ".", "a/..", ...),
+// which dir is then set to
+static int resolve_path(const char* path, struct working_dir* dir, char* name){
+    memcpy(dir, op_dir ? op_dir : &cwd, sizeof(struct working_dir));
+    if(path[0]=='/'){
+      dir->depth = 0;
+    }
+    size_t len = strlen(path);
+    while(len>0 && path[len-1]=='/'){ // "dir/" is just dir
+      len--;
+    }
+    size_t last = len;
+    while(last>0 && path[last-1]!='/'){
+      last--;
+    }
+    int ret = walk_dirs(path, last, dir);
+    if(ret<0){
+      return ret;
+    }
+    size_t n = len-last;
+    name[0] = '\0';
+    if(n==2 && !strncmp(path+last, "..", 2)){
+      if(dir->depth>0){
+        dir->depth--;
+      }
+    }
+    else if(n>0 && !(n==1 && path[last]=='.')){
+      n = n>MAX_NAME_LENGTH+1 ? MAX_NAME_LENGTH+1 : n;
+      memcpy(name, path+last, n);
+      name[n] = '\0';
+    }
+    return 0;
+}
+
+// the directory a jfs_* function runs in is put back when it returns
+static void restore_op_dir(struct working_dir** saved){
+    op_dir = *saved;
+}
+
+// Resolves path (see resolve_path) and runs the rest of the calling jfs_*
+// function in the directory that holds its last component, whose name it
+// declares as name (NULL if the path names a directory itself).  Plain
+// names, and NULL, are used as they are.
+#define IN_PATH_DIR(path, name) \
+    struct working_dir* caller_op_dir __attribute__((cleanup(restore_op_dir))) = op_dir; \
+    struct working_dir path_dir; \
+    char name##_buf[MAX_NAME_LENGTH+2]; \
+    const char* name = path; \
+    do{ \
+      if(path!=NULL && (strchr(path, '/')!=NULL || !strcmp(path, ".") || !strcmp(path, ".."))){ \
+        int resolve_ret = resolve_path(path, &path_dir, name##_buf); \
+        if(resolve_ret<0){ \
+          return resolve_ret; \
+        } \
+        op_dir = &path_dir; \
+        name = name##_buf[0]!='\0' ? name##_buf : NULL; \
+      } \
+    }while(0)
+
+// whether a directory is the current directory or one of its ancestors
+static bool_t on_cwd_path(block_num_t block_num){
+    for(int depth=0; depth<=cwd.depth; depth++){
+      if(cwd.path[depth]==block_num){
+        return TRUE;
+      }
+    }
+    return FALSE;
+}
+
+// Snapshots.  Blocks are shared between the live tree and any number of
+// snapshots, and a block's reference count (kept by the bfs layer next to
+// the bitmap) is the number of directory blocks, inodes or snapshot table
+// entries that point to it.  Taking a snapshot just records the root's block
+// in the table and takes a reference to it.  Before the live tree changes a
+// block that is shared, it copies it (taking a reference to everything the
+// block points to, for the copy), switches the parent over to the copy and
+// drops its reference to the original, which the snapshots keep.  The live
+// root stays in block 1: when it is shared, the snapshots are switched over
+// to the copy instead.  The table lives in the aux area, after the bfs
+// reference counts.
+#define SNAPSHOT_TABLE_OFFSET NUM_BLOCKS
+struct snapshot_entry {
+    char name[MAX_NAME_LENGTH+1];
+    block_num_t root; // 0 if the entry is unused
+    uint16_t reserved;
+    uint32_t created;
+};
+static struct snapshot_entry snapshots[MAX_SNAPSHOTS];
+static bool_t read_only; // a snapshot is mounted
+// where each directory block copied from a snapshot went, so asynchronous
+// requests submitted before the copy still find their directory
+static block_num_t cow_moved[NUM_BLOCKS];
+
+static int store_snapshots(){
+    return raw_write_aux(SNAPSHOT_TABLE_OFFSET, snapshots, sizeof(snapshots));
+}
+
+// returns the index of the snapshot with this name, or -1 if there is none
+static int find_snapshot(const char* name){
+    for(int i=0; i<MAX_SNAPSHOTS; i++){
+      if(snapshots[i].root!=0 && !strncmp(snapshots[i].name, name, MAX_NAME_LENGTH+1)){
+        return i;
+      }
+    }
+    return -1;
+}
+
+// takes a reference to every block a directory block or inode points to
+// returns 0 on success, or -1 (with no references taken) on failure
+static int share_children(const struct block* block){
+    block_num_t children[MAX_DATA_BLOCKS];
+    int count = 0;
+    if(block->is_dir==0){ // it is a directory
+      for(int i=0; i<block->contents.dirnode.num_entries; i++){
+        children[count++] = block->contents.dirnode.entries[i].block_num;
+      }
+    }
+    else{ // it is a file
+      count = count_num_data_block(block->contents.inode.file_size);
+      memcpy(children, block->contents.inode.data_blocks, count*sizeof(block_num_t));
+    }
+    for(int i=0; i<count; i++){
+      if(share_block(children[i])<0){
+        while(i-->0){
+          release_block(children[i]);
+        }
+        return -1;
+      }
+    }
+    return 0;
+}
+
+// copies a shared directory block or inode (read into *block) to a new block
+// returns the copy's block number, or 0 if there is no room for it
+static block_num_t copy_shared_block(block_num_t block_num, struct block* block){
+    if(read_jfs_block(block_num, block)<0){
+      return 0;
+    }
+    block_num_t copy_num = allocate_block_near(block_num);
+    if(copy_num==0){
+      return 0;
+    }
+    // (the copy isn't referenced by anything until the caller links it in)
+    if(write_jfs_block(copy_num, block)<0 || share_children(block)<0){
+      release_block(copy_num);
+      return 0;
+    }
+    cow_moved[copy_num] = 0;
+    return copy_num;
+}
+
+// makes sure that entry i of the directory dir_num (which must not be shared
+// itself) points to a block that is not shared with a snapshot
+// returns the block the entry points to now, or 0 if there was no room to
+// copy it
+static block_num_t unshare_entry(block_num_t dir_num, int i){
+    struct block dirBlock;
+    if(read_jfs_block(dir_num, &dirBlock)<0){
+      return 0;
+    }
+    block_num_t child_num = dirBlock.contents.dirnode.entries[i].block_num;
+    if(block_ref_count(child_num)<=1){
+      return child_num;
+    }
+    struct block child;
+    block_num_t copy_num = copy_shared_block(child_num, &child);
+    if(copy_num==0){
+      return 0;
+    }
+    if(meta_nodes[child_num]!=NULL){ // the in-memory copy follows the live tree
+      meta_insert(copy_num, &child);
+      meta_drop(child_num);
+    }
+    dirBlock.contents.dirnode.entries[i].block_num = copy_num;
+    write_jfs_block(dir_num, &dirBlock);
+    release_block(child_num);
+    cow_moved[child_num] = copy_num;
+    if(child.is_dir==0){ // a directory moved, and with it the paths through it
+      path_cache_invalidate();
+      for(int depth=1; depth<=cwd.depth; depth++){
+        if(cwd.path[depth]==child_num){
+          cwd.path[depth] = copy_num;
+        }
+      }
+    }
+    return copy_num;
+}
+
+// makes sure the live root is not shared with a snapshot
+static int unshare_root(){
+    block_num_t root = dir_path[0];
+    int refs = block_ref_count(root);
+    if(refs<=1){
+      return 0;
+    }
+    // the copy goes to the refs-1 snapshots that point to the root
+    struct block block;
+    block_num_t copy_num = copy_shared_block(root, &block);
+    if(copy_num==0){
+      return E_DISK_FULL;
+    }
+    for(int i=2; i<refs; i++){
+      share_block(copy_num);
+    }
+    for(int i=0; i<MAX_SNAPSHOTS; i++){
+      if(snapshots[i].root==root){
+        snapshots[i].root = copy_num;
+      }
+    }
+    store_snapshots();
+    for(int i=1; i<refs; i++){
+      release_block(root);
+    }
+    return 0;
+}
+
+// Every jfs_* function that changes the file system calls this before it
+// changes anything: it fails on a read-only mount, and otherwise unshares
+// the current directory and its ancestors (whose blocks, and counters, the
+// function may write)
+static int prepare_update(){
+    if(read_only){
+      return E_READ_ONLY;
+    }
+    for(int depth=0; depth<=dir_depth; depth++){
+      while(cow_moved[dir_path[depth]]!=0){
+        dir_path[depth] = cow_moved[dir_path[depth]];
+      }
+    }
+    int ret = unshare_root();
+    if(ret<0){
+      return ret;
+    }
+    for(int depth=1; depth<=dir_depth; depth++){
+      struct block parent;
+      ret = read_jfs_block(dir_path[depth-1], &parent);
+      if(ret<0){
+        return ret;
+      }
+      int i = 0;
+      while(i<parent.contents.dirnode.num_entries && parent.contents.dirnode.entries[i].block_num!=dir_path[depth]){
+        i++;
+      }
+      if(i==parent.contents.dirnode.num_entries){
+        return E_NOT_EXISTS; // removed by another request meanwhile
+      }
+      block_num_t block_num = unshare_entry(dir_path[depth-1], i);
+      if(block_num==0){
+        return E_DISK_FULL;
+      }
+      dir_path[depth] = block_num;
+    }
+    return 0;
+}
+#define PREPARE_UPDATE() \
+    do{ \
+      int prepare_ret = prepare_update(); \
+      if(prepare_ret<0){ \
+        return prepare_ret; \
+      } \
+    }while(0)
+
 int rm_subdir_or_file_from_current_dir(const char* name){
     char *buffer = malloc(BLOCK_SIZE);
     struct block *dirBlock = malloc(sizeof(struct block));
     bzero(buffer, BLOCK_SIZE);
     bzero(dirBlock, sizeof(struct block));
-    read_block(current_dir, buffer);
+    int ret = read_jfs_block(current_dir, buffer);
+    if(ret<0){
+      free(buffer);
+      free(dirBlock);
+      return ret;
+    }
     memcpy(dirBlock, buffer, sizeof(struct block));
     uint16_t num_entries = dirBlock->contents.dirnode.num_entries;
     for(int i=0; i<num_entries; i++){
@@ -115,13 +992,15 @@ int rm_subdir_or_file_from_current_dir(const char* name){
             dirBlock->contents.dirnode.entries[i].block_num = dirBlock->contents.dirnode.entries[num_entries-1].block_num;
             bzero(dirBlock->contents.dirnode.entries[i].name, MAX_NAME_LENGTH);
             memcpy(dirBlock->contents.dirnode.entries[i].name, dirBlock->contents.dirnode.entries[num_entries-1].name, MAX_NAME_LENGTH);
+            set_entry_type(dirBlock, i, entry_is_dir(dirBlock, num_entries-1));
+            set_entry_type(dirBlock, num_entries-1, FALSE);
             dirBlock->contents.dirnode.entries[num_entries-1].block_num = 0;
             bzero(dirBlock->contents.dirnode.entries[num_entries-1].name, MAX_NAME_LENGTH);
             dirBlock->contents.dirnode.num_entries--;
             // write back to disk
             bzero(buffer, BLOCK_SIZE);
             memcpy(buffer, dirBlock, sizeof(struct block));
-            write_block(current_dir, buffer);
+            write_jfs_block(current_dir, buffer);
             free(buffer);
             free(dirBlock);
             return 0; // succeed
@@ -137,15 +1016,20 @@ int create_inode_subdir_block(const char* name, int is_dir){
     if(strlen(name)>MAX_NAME_LENGTH){
       return E_MAX_NAME_LENGTH;
     }
-    if(count_occupied_disk_size(2*BLOCK_SIZE, 1)+BLOCK_SIZE > BLOCK_SIZE*NUM_BLOCKS){// will exceed disk capacity after this (initial size: 2*BLOCK_SIZE accounts for superblock and root directory block)
+    if(count_free_blocks()<1){ // will exceed disk capacity after this
       return E_DISK_FULL;
     }
     char *buffer = malloc(BLOCK_SIZE);
     struct block *dirBlock = malloc(sizeof(struct block));
     bzero(buffer, BLOCK_SIZE);
     bzero(dirBlock, sizeof(struct block));
-    read_block(current_dir, buffer);
-    memcpy(dirBlock, buffer, sizeof(struct block));
+    int ret = read_jfs_block(current_dir, buffer);
+    if(ret<0){
+      free(dirBlock);
+      free(buffer);
+      return ret;
+    }
+    memcpy(dirBlock, buffer, sizeof(struct block));
     if(dirBlock->contents.dirnode.num_entries>=MAX_DIR_ENTRIES){
       free(dirBlock);
       free(buffer);
@@ -158,21 +1042,25 @@ int create_inode_subdir_block(const char* name, int is_dir){
         return E_EXISTS;
       }
     }
-    // allocate new block for sub-directory/inode
-    block_num_t dirNum = allocate_block();
+    // allocate new block for sub-directory/inode, in its parent's group
+    block_num_t dirNum = allocate_block_near(current_dir);
     // update current directory info
     dirBlock->contents.dirnode.entries[dirBlock->contents.dirnode.num_entries].block_num = dirNum;
     memcpy(dirBlock->contents.dirnode.entries[dirBlock->contents.dirnode.num_entries].name, name, MAX_NAME_LENGTH);
+    set_entry_type(dirBlock, dirBlock->contents.dirnode.num_entries, is_dir==0);
     dirBlock->contents.dirnode.num_entries++;
     bzero(buffer, BLOCK_SIZE);
     memcpy(buffer, dirBlock, sizeof(struct block));
-    write_block(current_dir, buffer);
+    write_jfs_block(current_dir, buffer);
     // store sub-directory/inode info
     bzero(buffer, BLOCK_SIZE);
     bzero(dirBlock, sizeof(struct block));
     dirBlock->is_dir=is_dir;
     memcpy(buffer, dirBlock, sizeof(struct block));
-    write_block(dirNum, buffer);
+    if(write_jfs_block(dirNum, buffer)==0){
+      meta_insert(dirNum, buffer);
+    }
+    update_subtree_counters(1, 0);
     // free pointers
     free(dirBlock);
     free(buffer);
@@ -182,54 +1070,178 @@ int create_inode_subdir_block(const char* name, int is_dir){
 /* jfs_mount
  *   prepares the DISK file on the _real_ file system to have file system
  *   blocks read and written to it.  The application _must_ call this function
- *   exactly once before calling any other jfs_* functions.  If your code
- *   requires any additional one-time initialization before any other jfs_*
- *   functions are called, you can add it here.
+ *   (or jfs_mount_with_options) exactly once before calling any other jfs_*
+ *   functions.  If your code requires any additional one-time initialization
+ *   before any other jfs_* functions are called, you can add it here.
  * filename - the name of the DISK file on the _real_ file system
  * returns 0 on success or -1 on error; errors should only occur due to
  *   errors in the underlying disk syscalls.
  */
 int jfs_mount(const char* filename) {
-    int ret = bfs_mount(filename);
-    current_dir = 1;
+    struct mount_options options;
+    bzero(&options, sizeof(options));
+    return jfs_mount_with_options(filename, &options);
+}
+
+/* jfs_parse_durability
+ *   parses a durability policy given on a command line (none,
+ *   periodic[:interval_ms] or sync) into the mount options
+ * arg - the policy
+ * options - the options whose durability (and flush_interval_ms) are set
+ * returns 0 on success or -1 if the policy is not valid
+ */
+int jfs_parse_durability(const char* arg, struct mount_options* options) {
+    if(0==strcmp(arg, "none")){
+      options->durability = JFS_DURABILITY_NONE;
+    }
+    else if(0==strcmp(arg, "sync")){
+      options->durability = JFS_DURABILITY_SYNC;
+    }
+    else if(0==strncmp(arg, "periodic", 8) && ('\0'==arg[8] || ':'==arg[8])){
+      options->durability = JFS_DURABILITY_PERIODIC;
+      options->flush_interval_ms = ':'==arg[8] ? atoi(arg+9) : 0;
+    }
+    else{
+      return -1;
+    }
+    return 0;
+}
+
+/* jfs_mount_with_options
+ *   same as jfs_mount, but lets the caller turn on optional features
+ * filename - the name of the DISK file on the _real_ file system
+ * options - the features to enable (see struct mount_options)
+ * returns 0 on success or -1 on error (with errno set to ENOENT if
+ *   options->snapshot names no snapshot)
+ */
+int jfs_mount_with_options(const char* filename, const struct mount_options* options) {
+    int ret;
+    if(options->num_stripe_files>0){
+      ret = bfs_mount_striped(options->stripe_files, options->num_stripe_files, options->stripe_unit);
+    }
+    else{
+      ret = bfs_mount(filename);
+    }
+    if(ret==0 && (options->flags & JFS_MOUNT_DIRECT_IO) && raw_set_direct_io(1)<0){
+      bfs_unmount();
+      return -1;
+    }
+    if(ret==0 && (options->flags & JFS_MOUNT_EXTENT_ALLOC) && bfs_use_extent_tree()<0){
+      bfs_unmount();
+      return -1;
+    }
+    // the live root is always block 1; a snapshot is mounted at its own root
+    bzero(snapshots, sizeof(snapshots));
+    bzero(cow_moved, sizeof(cow_moved));
+    path_cache_invalidate(); // (another image may have been mounted before)
+    if(ret==0){
+      ret = raw_read_aux(SNAPSHOT_TABLE_OFFSET, snapshots, sizeof(snapshots));
+    }
+    dir_path[0] = 1;
+    dir_depth = 0;
+    read_only = FALSE;
+    if(ret==0 && options->snapshot!=NULL){
+      int i = find_snapshot(options->snapshot);
+      if(i<0){
+        bfs_unmount();
+        errno = ENOENT;
+        return -1;
+      }
+      dir_path[0] = snapshots[i].root;
+      read_only = TRUE;
+    }
+    async_pool_size = options->num_async_workers>0 ? options->num_async_workers : DEFAULT_ASYNC_WORKERS;
+    if(async_pool_size>MAX_ASYNC_WORKERS){
+      async_pool_size = MAX_ASYNC_WORKERS;
+    }
+    async_event_fd = eventfd(0, EFD_NONBLOCK|EFD_SEMAPHORE);
+    // fill in the subtree counters and entry types if this image predates them
+    struct block root;
+    uint8_t all_valid = DIR_COUNTERS_VALID|DIR_TYPES_VALID;
+    if(ret==0 && !read_only && read_block(1, &root)==0 && (root.contents.dirnode.flags & all_valid)!=all_valid){
+      struct usage total;
+      rebuild_dir_metadata(1, &total);
+    }
+    // reset the dedup index, and rebuild it from the files on disk if needed
+    dedup_enabled = (options->flags & JFS_MOUNT_DEDUP) ? TRUE : FALSE;
+    bzero(dedup_buckets, sizeof(dedup_buckets));
+    bzero(dedup_indexed, sizeof(dedup_indexed));
+    if(ret==0 && dedup_enabled){
+      dedup_index_tree(dir_path[0]);
+    }
+    // load the metadata into memory
+    meta_unload();
+    meta_enabled = (options->flags & JFS_MOUNT_METADATA_CACHE) ? TRUE : FALSE;
+    if(ret==0 && meta_enabled){
+      meta_load_tree(dir_path[0]);
+    }
+    durability = options->durability;
+    if(ret==0 && durability==JFS_DURABILITY_PERIODIC){
+      start_flusher(options->flush_interval_ms);
+    }
     return ret;
 }
 
 /* jfs_mkdir
- *   creates a new subdirectory in the current directory
- * directory_name - name of the new subdirectory
+ *   creates a new directory
+ * path - path of the new subdirectory; like every path the jfs_* functions
+ *   take, it is relative to the current directory unless it starts with /,
+ *   and may go through . and .. (e.g. "../a/b" or "/a/b")
  * returns 0 on success or one of the following error codes on failure:
- *   E_EXISTS, E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES, E_DISK_FULL
+ *   E_EXISTS, E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES, E_DISK_FULL, E_READ_ONLY
  */
-int jfs_mkdir(const char* directory_name) {
+int jfs_mkdir(const char* path) {
+    TRACE_CALL(JFS_OP_MKDIR, path, 0);
+    LOCK_FS_EXCLUSIVE();
+    IN_PATH_DIR(path, directory_name);
+    if(directory_name==NULL){
+      return E_EXISTS;
+    }
+    PREPARE_UPDATE();
     return create_inode_subdir_block(directory_name, 0);
 }
 
 /* jfs_chdir
- *   changes the current directory to the specified subdirectory, or changes
- *   the current directory to the root directory if the directory_name is NULL
- * directory_name - name of the subdirectory to make the current
- *   directory; if directory_name is NULL then the current directory
- *   should be made the root directory instead
+ *   changes the current directory to the specified directory, or changes
+ *   the current directory to the root directory if the path is NULL
+ * path - path of the directory to make the current directory (e.g. "a/b",
+ *   ".." or "/"); if path is NULL then the current directory should be made
+ *   the root directory instead
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_NOT_DIR
+ *   E_NOT_EXISTS, E_NOT_DIR, E_MAX_DIR_DEPTH
  */
-int jfs_chdir(const char* directory_name) {
-    if(directory_name==NULL){
-      current_dir = 1; //change to root directory
+int jfs_chdir(const char* path) {
+    TRACE_CALL(JFS_OP_CHDIR, path, 0);
+    LOCK_FS_EXCLUSIVE();
+    if(path==NULL){
+      (op_dir!=NULL ? op_dir : &cwd)->depth = 0; //change to root directory
       return 0;
     }
-    block_num_t block_num = find_block_num_by_name(directory_name);
-    if(block_num==0){
-      return E_NOT_EXISTS;
-    }
-    else if(!is_dir(block_num)){ // if this is a file
-      return E_NOT_DIR;
-    }
-    else{ // if this is a directory
-      current_dir = block_num;
-      return 0;
+    IN_PATH_DIR(path, directory_name);
+    // the resolved directory lives on this frame, so copy it out to the caller's
+    struct working_dir target = *(op_dir!=NULL ? op_dir : &cwd);
+    if(directory_name!=NULL){
+      int block_num = find_block_num_by_name(directory_name);
+      if(block_num<0){
+        return block_num;
+      }
+      else if(block_num==0){
+        return E_NOT_EXISTS;
+      }
+      int ret = is_dir(block_num);
+      if(ret<0){
+        return ret;
+      }
+      else if(!ret){ // if this is a file
+        return E_NOT_DIR;
+      }
+      else if(target.depth==MAX_DIR_DEPTH){
+        return E_MAX_DIR_DEPTH;
+      }
+      target.path[++target.depth] = block_num;
     }
+    *(caller_op_dir!=NULL ? caller_op_dir : &cwd) = target;
+    return 0;
 }
 
 /* jfs_ls
@@ -246,24 +1258,23 @@ int jfs_chdir(const char* directory_name) {
  *   (this function should always succeed)
  */
 int jfs_ls(char* directories[MAX_DIR_ENTRIES+1], char* files[MAX_DIR_ENTRIES+1]) {
-    char *buffer = malloc(BLOCK_SIZE);
-    struct block *dirBlock = malloc(sizeof(struct block));
-    bzero(buffer, BLOCK_SIZE);
-    bzero(dirBlock, sizeof(struct block));
-    read_block(current_dir, buffer);
-    memcpy(dirBlock, buffer, sizeof(struct block));
-    uint16_t num_entries = dirBlock->contents.dirnode.num_entries;
+    struct jfs_dir dir;
+    struct jfs_dirent entry;
+    int ret = jfs_opendir(NULL, &dir);
+    if(ret<0){
+      return ret;
+    }
     int dirCount=0;
     int filecount=0;
-    for(int i=0; i<num_entries; i++){
-        if(is_dir(dirBlock->contents.dirnode.entries[i].block_num)){ // if this is a directory
-          directories[dirCount] = malloc(MAX_NAME_LENGTH);
-          memcpy(directories[dirCount],dirBlock->contents.dirnode.entries[i].name,MAX_NAME_LENGTH); 
+    while(jfs_readdir(&dir, &entry)){
+        if(entry.is_dir==0){ // if this is a directory
+          directories[dirCount] = malloc(MAX_NAME_LENGTH+1);
+          memcpy(directories[dirCount],entry.name,MAX_NAME_LENGTH+1);
           dirCount++;
         }
         else{ // if this is a regular file
-          files[filecount] = malloc(MAX_NAME_LENGTH);
-          memcpy(files[filecount],dirBlock->contents.dirnode.entries[i].name,MAX_NAME_LENGTH); 
+          files[filecount] = malloc(MAX_NAME_LENGTH+1);
+          memcpy(files[filecount],entry.name,MAX_NAME_LENGTH+1);
           filecount++;
         }
     }
@@ -274,33 +1285,114 @@ int jfs_ls(char* directories[MAX_DIR_ENTRIES+1], char* files[MAX_DIR_ENTRIES+1])
     for(unsigned long i=filecount; i<MAX_DIR_ENTRIES+1; i++){
       files[i]=NULL;
     }
-    // free pointers
-    free(dirBlock);
-    free(buffer);
     return 0;
 }
 
+/* jfs_opendir
+ *   starts iterating over the entries of a directory; the directory block is
+ *   read once, here, and jfs_readdir() then returns its entries (with their
+ *   types) without reading anything else or allocating memory
+ * path - path of the directory, or NULL for the current directory itself
+ * dir - iterator (allocated by the caller) to initialize; there is nothing to
+ *   close or free when done with it
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_NOT_DIR, E_CHECKSUM
+ */
+int jfs_opendir(const char* path, struct jfs_dir* dir) {
+    TRACE_CALL(JFS_OP_OPENDIR, path, 0);
+    LOCK_FS_SHARED();
+    IN_PATH_DIR(path, directory_name);
+    block_num_t block_num = current_dir;
+    if(directory_name!=NULL){
+      int found = find_block_num_by_name(directory_name);
+      if(found<0){
+        return found;
+      }
+      else if(found==0){
+        return E_NOT_EXISTS;
+      }
+      block_num = found;
+    }
+    int ret = read_jfs_block(block_num, &dir->dir_block);
+    if(ret<0){
+      return ret;
+    }
+    if(dir->dir_block.is_dir!=0){
+      return E_NOT_DIR;
+    }
+    dir->next = 0;
+    return 0;
+}
+
+/* jfs_readdir
+ *   returns the next entry of a directory opened with jfs_opendir()
+ * dir - the iterator
+ * entry - pointer to a struct jfs_dirent (allocated by the caller) where the
+ *   entry will be written
+ * returns 1 if an entry was written, or 0 once all entries have been returned
+ */
+int jfs_readdir(struct jfs_dir* dir, struct jfs_dirent* entry) {
+    if(dir->next>=dir->dir_block.contents.dirnode.num_entries){
+      return 0;
+    }
+    int i = dir->next++;
+    entry->is_dir = entry_is_dir(&dir->dir_block, i) ? 0 : 1;
+    memcpy(entry->name, dir->dir_block.contents.dirnode.entries[i].name, MAX_NAME_LENGTH);
+    entry->name[MAX_NAME_LENGTH] = '\0';
+    entry->block_num = dir->dir_block.contents.dirnode.entries[i].block_num;
+    return 1;
+}
+
 /* jfs_rmdir
- *   removes the specified subdirectory of the current directory
- * directory_name - name of the subdirectory to remove
+ *   removes the specified directory
+ * path - path of the directory to remove
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_NOT_DIR, E_NOT_EMPTY
+ *   E_NOT_EXISTS, E_NOT_DIR, E_NOT_EMPTY, E_INVALID (the path names no entry,
+ *   or the directory is the current directory or one of its ancestors),
+ *   E_READ_ONLY
  */
-int jfs_rmdir(const char* directory_name) {
-    block_num_t block_num = find_block_num_by_name(directory_name);
-    if(block_num==0){
+int jfs_rmdir(const char* path) {
+    TRACE_CALL(JFS_OP_RMDIR, path, 0);
+    LOCK_FS_EXCLUSIVE();
+    IN_PATH_DIR(path, directory_name);
+    if(directory_name==NULL){
+      return E_INVALID;
+    }
+    PREPARE_UPDATE();
+    int block_num = find_block_num_by_name(directory_name);
+    if(block_num<0){
+      return block_num;
+    }
+    else if(block_num==0){
       return E_NOT_EXISTS;
     }
-    else if(!is_dir(block_num)){ // if this is a file
+    int ret = is_dir(block_num);
+    if(ret<0){
+      return ret;
+    }
+    else if(!ret){ // if this is a file
       return E_NOT_DIR;
     }
     else{ // if this is a directory
-      if(!is_empty_dir(block_num)){
+      ret = is_empty_dir(block_num);
+      if(ret<0){
+        return ret;
+      }
+      else if(!ret){
         return E_NOT_EMPTY;
       }
+      else if(on_cwd_path(block_num)){
+        return E_INVALID;
+      }
       else{
-        rm_subdir_or_file_from_current_dir(directory_name);
+        ret = rm_subdir_or_file_from_current_dir(directory_name);
+        if(ret<0){
+          return ret;
+        }
         release_block(block_num);
+        meta_drop(block_num);
+        update_subtree_counters(-1, 0);
+        path_cache_invalidate();
         return 0;
       }
     }
@@ -308,74 +1400,139 @@ int jfs_rmdir(const char* directory_name) {
 
 /* jfs_creat
  *   creates a new, empty file with the specified name
- * file_name - name to give the new file
+ * path - path of the new file
  * returns 0 on success or one of the following error codes on failure:
- *   E_EXISTS, E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES, E_DISK_FULL
+ *   E_EXISTS, E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES, E_DISK_FULL, E_READ_ONLY
  */
-int jfs_creat(const char* file_name) {
+int jfs_creat(const char* path) {
+    TRACE_CALL(JFS_OP_CREAT, path, 0);
+    LOCK_FS_EXCLUSIVE();
+    IN_PATH_DIR(path, file_name);
+    if(file_name==NULL){
+      return E_EXISTS;
+    }
+    PREPARE_UPDATE();
     return create_inode_subdir_block(file_name, 1);
 }
 
 /* jfs_remove
  *   deletes the specified file and all its data (note that this cannot delete
  *   directories; use rmdir instead to remove directories)
- * file_name - name of the file to remove
+ * path - path of the file to remove
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_IS_DIR
+ *   E_NOT_EXISTS, E_IS_DIR, E_READ_ONLY
  */
-int jfs_remove(const char* file_name) {
-    block_num_t block_num = find_block_num_by_name(file_name);
-    if(block_num==0){
+static void release_file(block_num_t inode_num, struct usage* freed);
+
+int jfs_remove(const char* path) {
+    TRACE_CALL(JFS_OP_REMOVE, path, 0);
+    LOCK_FS_EXCLUSIVE();
+    IN_PATH_DIR(path, file_name);
+    if(file_name==NULL){
+      return E_IS_DIR;
+    }
+    PREPARE_UPDATE();
+    int block_num = find_block_num_by_name(file_name);
+    if(block_num<0){
+      return block_num;
+    }
+    else if(block_num==0){
       return E_NOT_EXISTS;
     }
-    else if(is_dir(block_num)){ // if this is a directory
+    int ret = is_dir(block_num);
+    if(ret<0){
+      return ret;
+    }
+    else if(ret){ // if this is a directory
       return E_IS_DIR;
     }
     else{ // if this is a file
-      rm_subdir_or_file_from_current_dir(file_name);
-      // read inode info and release all data blocks
-      char *buffer = malloc(BLOCK_SIZE);
-      struct block *dirBlock = malloc(sizeof(struct block));
-      bzero(buffer, BLOCK_SIZE);
-      bzero(dirBlock, sizeof(struct block));
-      read_block(block_num, buffer);
-      memcpy(dirBlock, buffer, sizeof(struct block));
-      int num_data_blocks = count_num_data_block(dirBlock->contents.inode.file_size);
-      for(int i=0; i<num_data_blocks; i++){
-        release_block(dirBlock->contents.inode.data_blocks[i]);
+      ret = rm_subdir_or_file_from_current_dir(file_name);
+      if(ret<0){
+        return ret;
       }
-      // release inode block
-      release_block(block_num);
-      // free pointers
-      free(dirBlock);
-      free(buffer);
+      struct usage freed;
+      release_file(block_num, &freed);
+      update_subtree_counters(-freed.num_blocks, -freed.num_bytes);
       return 0;
     }
 }
 
+// releases a file's data blocks and inode, and reports how much was freed
+static void release_file(block_num_t inode_num, struct usage* freed){
+    struct block inode;
+    bzero(&inode, sizeof(inode));
+    read_jfs_block(inode_num, &inode);
+    int num_data_blocks = count_num_data_block(inode.contents.inode.file_size);
+    if(block_ref_count(inode_num)<=1){ // (a snapshot's inode keeps its data)
+      for(int i=0; i<num_data_blocks; i++){
+        release_data_block(inode.contents.inode.data_blocks[i]);
+      }
+    }
+    // release inode block
+    release_block(inode_num);
+    meta_drop(inode_num);
+    freed->num_blocks = 1+num_data_blocks;
+    freed->num_bytes = inode.contents.inode.file_size;
+}
+
 /* jfs_stat
  *   returns the file or directory stats (see struct stat for details)
- * name - name of the file or directory to inspect
+ * path - path of the file or directory to inspect
  * buf  - pointer to a struct stat (already allocated by the caller) where the
  *   stats will be written
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS
+ *   E_NOT_EXISTS, E_CHECKSUM
  */
-int jfs_stat(const char* name, struct stats* buf) {
+int jfs_stat(const char* path, struct stats* buf) {
+    TRACE_CALL(JFS_OP_STAT, path, 0);
+    LOCK_FS_SHARED();
+    IN_PATH_DIR(path, name);
+    if(name==NULL){ // the path names a directory itself, so look its name up in its parent
+      bzero(buf, sizeof(struct stats));
+      buf->block_num = current_dir;
+      if(dir_depth==0){
+        strcpy(buf->name, "/");
+        return 0;
+      }
+      struct block parentBlock;
+      int ret = read_jfs_block(dir_path[dir_depth-1], &parentBlock);
+      if(ret<0){
+        return ret;
+      }
+      for(int i=0; i<parentBlock.contents.dirnode.num_entries; i++){
+        if(parentBlock.contents.dirnode.entries[i].block_num==current_dir){
+          memcpy(buf->name, parentBlock.contents.dirnode.entries[i].name, MAX_NAME_LENGTH);
+        }
+      }
+      return 0;
+    }
     int block_num = find_block_num_by_name(name);
-    if(block_num==0){
+    if(block_num<0){
+      return block_num;
+    }
+    else if(block_num==0){
       return E_NOT_EXISTS;
     }
     memcpy(buf->name, name, MAX_NAME_LENGTH);
     buf->block_num = block_num;
-    if(!is_dir(block_num)){ // if this is a file 
+    int type = is_dir(block_num);
+    if(type<0){
+      return type;
+    }
+    if(!type){ // if this is a file 
       buf->is_dir = 1;
       // read inode info
       char *buffer = malloc(BLOCK_SIZE);
       struct block *dirBlock = malloc(sizeof(struct block));
       bzero(buffer, BLOCK_SIZE);
       bzero(dirBlock, sizeof(struct block));
-      read_block(block_num, buffer);
+      int ret = read_jfs_block(block_num, buffer);
+      if(ret<0){
+        free(dirBlock);
+        free(buffer);
+        return ret;
+      }
       memcpy(dirBlock, buffer, sizeof(struct block));
       uint32_t file_size = dirBlock->contents.inode.file_size;
       uint16_t num_data_blocks = count_num_data_block(file_size);
@@ -393,28 +1550,59 @@ int jfs_stat(const char* name, struct stats* buf) {
 
 /* jfs_write
  *   appends the data in the buffer to the end of the specified file
- * file_name - name of the file to append data to
+ * path - path of the file to append data to
  * buf - buffer containing the data to be written (note that the data could be
  *   binary, not text, and even if it is text should not be assumed to be null
  *   terminated)
  * count - number of bytes in buf (write exactly this many)
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_IS_DIR, E_MAX_FILE_SIZE, E_DISK_FULL
+ *   E_NOT_EXISTS, E_IS_DIR, E_MAX_FILE_SIZE, E_DISK_FULL, E_CHECKSUM,
+ *   E_READ_ONLY, E_UNKNOWN (the new data could not be written; the file is
+ *   left as it was)
  */
-int jfs_write(const char* file_name, const void* buf, unsigned short count) {
+int jfs_write(const char* path, const void* buf, unsigned short count) {
+    TRACE_CALL(JFS_OP_WRITE, path, count);
+    LOCK_FS_EXCLUSIVE();
+    IN_PATH_DIR(path, file_name);
+    if(file_name==NULL){
+      return E_IS_DIR;
+    }
+    PREPARE_UPDATE();
     int block_num = find_block_num_by_name(file_name);
-    if(block_num==0){
+    if(block_num<0){
+      return block_num;
+    }
+    else if(block_num==0){
       return E_NOT_EXISTS;
     }
-    if(is_dir(block_num)){ // if this is a directory
+    int ret = is_dir(block_num);
+    if(ret<0){
+      return ret;
+    }
+    else if(ret){ // if this is a directory
       return E_IS_DIR;
     }
+    // the inode changes, so it can't stay shared with a snapshot
+    struct block cwdBlock;
+    ret = read_jfs_block(current_dir, &cwdBlock);
+    if(ret<0){
+      return ret;
+    }
+    block_num = unshare_entry(current_dir, find_entry(&cwdBlock, file_name));
+    if(block_num==0){
+      return E_DISK_FULL;
+    }
     // read inode info
     char *buffer = malloc(BLOCK_SIZE);
     struct block *dirBlock = malloc(sizeof(struct block));
     bzero(buffer, BLOCK_SIZE);
     bzero(dirBlock, sizeof(struct block));
-    read_block(block_num, buffer);
+    ret = read_jfs_block(block_num, buffer);
+    if(ret<0){
+        free(dirBlock);
+        free(buffer);
+        return ret;
+    }
     memcpy(dirBlock, buffer, sizeof(struct block));
     uint32_t o_file_size = dirBlock->contents.inode.file_size;
     if(o_file_size+count>MAX_FILE_SIZE){
@@ -431,47 +1619,112 @@ int jfs_write(const char* file_name, const void* buf, unsigned short count) {
     else{
       add_num_data_blocks = count_num_data_block(count-(o_num_data_blocks*BLOCK_SIZE-o_file_size));
     }
-    if(count_occupied_disk_size(2*BLOCK_SIZE, 1)+add_num_data_blocks*BLOCK_SIZE > BLOCK_SIZE*NUM_BLOCKS){
+    // the head of the data goes to the partial last block (if there is one);
+    // if a snapshot still has that block, the longer version goes to a copy
+    uint32_t offset = o_num_data_blocks*BLOCK_SIZE-o_file_size; // space left in the partial block
+    if(offset>count){
+      offset = count;
+    }
+    block_num_t partial_block_num = offset>0 ? dirBlock->contents.inode.data_blocks[o_num_data_blocks-1] : 0;
+    int copy_partial = offset>0 && block_ref_count(partial_block_num)>1;
+    if(add_num_data_blocks+copy_partial>count_free_blocks()){ // shared blocks may make this an overestimate
       // free pointers
       free(dirBlock);
       free(buffer); 
       return E_DISK_FULL;
     }
-    // allocate new data blocks and update inode info
-    dirBlock->contents.inode.file_size = o_file_size+count;
+    // every block is allocated before anything is written, so that running
+    // out of space leaves the file as it was
+    void *partial_data = NULL;
+    block_num_t copy_num = 0;
+    if(offset>0){
+        partial_data = malloc(BLOCK_SIZE);
+        ret = read_jfs_block(partial_block_num,partial_data);
+        if(ret<0){
+            // the partial block is corrupted; don't append to it
+            free(partial_data);
+            free(dirBlock);
+            free(buffer);
+            return ret;
+        }
+        memcpy(partial_data+o_file_size-(o_num_data_blocks-1)*BLOCK_SIZE, buf, offset);
+        if(copy_partial){
+            copy_num = allocate_block_near(partial_block_num);
+            if(copy_num==0){
+                free(partial_data);
+                free(dirBlock);
+                free(buffer);
+                return E_DISK_FULL;
+            }
+        }
+    }
+    // write the rest of the data to new data blocks, all in one batch so
+    // that consecutive blocks (and blocks on different stripe members) are
+    // transferred together
+    char *new_data = malloc(add_num_data_blocks*BLOCK_SIZE+1);
+    block_num_t new_blocks[MAX_DATA_BLOCKS];
+    int num_new_blocks = 0;
+    // place the data right after the file's last block (or its inode)
+    block_num_t goal = o_num_data_blocks>0 ? dirBlock->contents.inode.data_blocks[o_num_data_blocks-1] : block_num;
     for(int i=0; i<add_num_data_blocks; i++){
-      block_num_t dirNum = allocate_block();
+      const char *data = (const char*)buf+offset+i*BLOCK_SIZE;
+      uint32_t len = count-offset-i*BLOCK_SIZE;
+      bool_t is_full = len>=BLOCK_SIZE;
+      block_num_t dirNum = 0;
+      if(dedup_enabled && is_full){ // share an identical block if there is one
+        dirNum = dedup_find(data, new_blocks, num_new_blocks, new_data);
+        if(dirNum!=0 && share_block(dirNum)<0){
+          dirNum = 0;
+        }
+      }
+      if(dirNum==0){
+        dirNum = allocate_block_near(goal);
+        if(dirNum==0){ // give back what this call took so far
+          undo_append(dirBlock, o_num_data_blocks, o_num_data_blocks+i, copy_num);
+          free(partial_data);
+          free(new_data);
+          free(dirBlock);
+          free(buffer);
+          return E_DISK_FULL;
+        }
+        goal = dirNum;
+        char *block_data = new_data+num_new_blocks*BLOCK_SIZE;
+        bzero(block_data, BLOCK_SIZE);
+        memcpy(block_data, data, is_full ? BLOCK_SIZE : len);
+        new_blocks[num_new_blocks++] = dirNum;
+        if(dedup_enabled && is_full){
+          dedup_insert(dirNum, block_data);
+        }
+      }
       dirBlock->contents.inode.data_blocks[i+o_num_data_blocks]=dirNum;
     }
+    // the new blocks (and the copy of a shared partial block) aren't part of
+    // the file until the inode is written, and in an unshared partial block
+    // only bytes past the end of the file change, so a failed write leaves
+    // the file as it was
+    ret = write_jfs_blocks(new_blocks, num_new_blocks, new_data);
+    if(ret==0 && offset>0){
+        ret = write_jfs_block(copy_num!=0 ? copy_num : partial_block_num, partial_data);
+    }
+    free(new_data);
+    if(ret<0){
+        undo_append(dirBlock, o_num_data_blocks, o_num_data_blocks+add_num_data_blocks, copy_num);
+        free(partial_data);
+        free(dirBlock);
+        free(buffer);
+        return E_UNKNOWN;
+    }
+    if(copy_num!=0){
+        release_data_block(partial_block_num); // (the snapshot keeps it)
+        dirBlock->contents.inode.data_blocks[o_num_data_blocks-1] = copy_num;
+    }
+    free(partial_data);
+    // update inode info
+    dirBlock->contents.inode.file_size = o_file_size+count;
     bzero(buffer, BLOCK_SIZE);
     memcpy(buffer, dirBlock, sizeof(struct block));
-    write_block(block_num,buffer);
-    // append data to data blocks
-    if(o_num_data_blocks*BLOCK_SIZE-o_file_size==0){ //if there is no partial block in original data blocks
-        for(int i=0; i<add_num_data_blocks; i++){
-          write_block(dirBlock->contents.inode.data_blocks[i+o_num_data_blocks],buf+i*BLOCK_SIZE);
-        }
-    }
-    else{ //if there is a partial block in original data blocks
-        void *new_buffer = malloc(BLOCK_SIZE);
-        block_num_t partial_block_num = dirBlock->contents.inode.data_blocks[o_num_data_blocks-1];
-        read_block(partial_block_num,new_buffer);
-        if(count<=o_num_data_blocks*BLOCK_SIZE-o_file_size){ //left space in the partial block is enough
-          memcpy(new_buffer+o_file_size-(o_num_data_blocks-1)*BLOCK_SIZE, buf, count); //append to the partial block
-          write_block(partial_block_num,new_buffer);
-        }
-        else{ //need to first append to the partial block, then append to extra data blocks
-            // append to the partial block
-            uint32_t offset = o_num_data_blocks*BLOCK_SIZE-o_file_size;
-            memcpy(new_buffer+o_file_size-(o_num_data_blocks-1)*BLOCK_SIZE, buf, offset);
-            write_block(partial_block_num,new_buffer);
-            // append to extra data blocks
-            for(int i=0; i<add_num_data_blocks; i++){
-              write_block(dirBlock->contents.inode.data_blocks[i+o_num_data_blocks],buf+offset+i*BLOCK_SIZE);
-            }
-        }
-        free(new_buffer);
-    }
+    write_jfs_block(block_num,buffer);
+    update_subtree_counters(add_num_data_blocks, count);
     // free pointers
     free(dirBlock);
     free(buffer); 
@@ -483,21 +1736,34 @@ int jfs_write(const char* file_name, const void* buf, unsigned short count) {
  *   reads the specified file and copies its contents into the buffer, up to a
  *   maximum of *ptr_count bytes copied (but obviously no more than the file
  *   size, either)
- * file_name - name of the file to read
+ * path - path of the file to read
  * buf - buffer where the file data should be written
  * ptr_count - pointer to a count variable (allocated by the caller) that
  *   contains the size of buf when it's passed in, and will be modified to
  *   contain the number of bytes actually written to buf (e.g., if the file is
  *   smaller than the buffer) if this function is successful
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_IS_DIR
+ *   E_NOT_EXISTS, E_IS_DIR, E_CHECKSUM
  */
-int jfs_read(const char* file_name, void* buf, unsigned short* ptr_count) {
+int jfs_read(const char* path, void* buf, unsigned short* ptr_count) {
+    TRACE_CALL(JFS_OP_READ, path, *ptr_count);
+    LOCK_FS_SHARED();
+    IN_PATH_DIR(path, file_name);
+    if(file_name==NULL){
+      return E_IS_DIR;
+    }
     int block_num = find_block_num_by_name(file_name);
-    if(block_num==0){
+    if(block_num<0){
+      return block_num;
+    }
+    else if(block_num==0){
       return E_NOT_EXISTS;
     }
-    if(is_dir(block_num)){ // if this is a directory
+    int ret = is_dir(block_num);
+    if(ret<0){
+      return ret;
+    }
+    else if(ret){ // if this is a directory
       return E_IS_DIR;
     }
     // read inode info
@@ -505,17 +1771,41 @@ int jfs_read(const char* file_name, void* buf, unsigned short* ptr_count) {
     struct block *dirBlock = malloc(sizeof(struct block));
     bzero(buffer, BLOCK_SIZE);
     bzero(dirBlock, sizeof(struct block));
-    read_block(block_num, buffer);
+    ret = read_jfs_block(block_num, buffer);
+    if(ret<0){
+      free(dirBlock);
+      free(buffer);
+      return ret;
+    }
     memcpy(dirBlock, buffer, sizeof(struct block));
     uint32_t file_size = dirBlock->contents.inode.file_size;
+    if(file_size>*ptr_count){ // only copy as much as fits in buf
+      file_size = *ptr_count;
+    }
     uint16_t num_data_blocks = count_num_data_block(file_size);
     *ptr_count = file_size;
+    uint16_t window = readahead_window(block_num);
+    int prefetched_to = 0; // data blocks before this index have been prefetched
     for(int i=0;i<num_data_blocks;i++){
+      if(i==prefetched_to){ // fetch the next window ahead of the reads
+        int n = num_data_blocks-i < window ? num_data_blocks-i : window;
+        raw_prefetch(&dirBlock->contents.inode.data_blocks[i], n);
+        prefetched_to = i+n;
+        if(n==window && window<READAHEAD_MAX_WINDOW){
+          window *= 2;
+        }
+      }
       bzero(buffer, BLOCK_SIZE);
-      read_block(dirBlock->contents.inode.data_blocks[i],buffer);
+      ret = read_jfs_block(dirBlock->contents.inode.data_blocks[i],buffer);
+      if(ret<0){
+        free(dirBlock);
+        free(buffer);
+        return ret;
+      }
       if(i==num_data_blocks-1){memcpy(buf+i*BLOCK_SIZE,buffer,file_size-(num_data_blocks-1)*BLOCK_SIZE);}
       else{memcpy(buf+i*BLOCK_SIZE,buffer,BLOCK_SIZE);}
     }
+    save_readahead_window(block_num, window);
     // free pointers
     free(dirBlock);
     free(buffer); 
@@ -523,6 +1813,1283 @@ int jfs_read(const char* file_name, void* buf, unsigned short* ptr_count) {
 }
 
 
+static int get_usage(block_num_t block_num, struct usage* buf);
+
+/* jfs_read_view
+ *   gives read-only access to a file's data without copying it: the data
+ *   blocks are pinned in the block cache and the view points straight at
+ *   them, with consecutive blocks merged into one segment where they sit
+ *   next to each other in the cache; the view stays valid (and unchanged,
+ *   even if the file is written or removed meanwhile) until it is released
+ * path - path of the file whose data to view
+ * count - maximum number of bytes to view
+ * view - the view (allocated by the caller) to fill in; view->iov and
+ *   view->iovcnt can be passed straight to writev(); it must be released with
+ *   jfs_release_view(), unless this returns an error
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_IS_DIR, E_CHECKSUM, E_UNKNOWN (out of memory for a copy)
+ */
+int jfs_read_view(const char* path, unsigned short count, struct jfs_view* view) {
+    TRACE_CALL(JFS_OP_READ_VIEW, path, count);
+    LOCK_FS_SHARED();
+    IN_PATH_DIR(path, file_name);
+    bzero(view, sizeof(struct jfs_view));
+    if(file_name==NULL){
+      return E_IS_DIR;
+    }
+    int block_num = find_block_num_by_name(file_name);
+    if(block_num<0){
+      return block_num;
+    }
+    else if(block_num==0){
+      return E_NOT_EXISTS;
+    }
+    int ret = is_dir(block_num);
+    if(ret<0){
+      return ret;
+    }
+    else if(ret){ // if this is a directory
+      return E_IS_DIR;
+    }
+    struct block inode;
+    ret = read_jfs_block(block_num, &inode);
+    if(ret<0){
+      return ret;
+    }
+    uint32_t file_size = inode.contents.inode.file_size;
+    if(file_size>count){
+      file_size = count;
+    }
+    int num_data_blocks = count_num_data_block(file_size);
+    raw_prefetch(inode.contents.inode.data_blocks, num_data_blocks);
+    for(int i=0; i<num_data_blocks; i++){
+      block_num_t data_block = inode.contents.inode.data_blocks[i];
+      size_t len = i==num_data_blocks-1 ? file_size-i*BLOCK_SIZE : BLOCK_SIZE;
+      const void* data;
+      ret = raw_pin_block(data_block, &data);
+      if(ret==0){
+        view->pinned[view->num_pinned++] = data_block;
+      }
+      else if(ret==RAW_E_BUSY){
+        // its cache slot is pinned by another block; fall back to a copy
+        if(view->copy==NULL){
+          view->copy = malloc(num_data_blocks*BLOCK_SIZE);
+          if(view->copy==NULL){
+            jfs_release_view(view);
+            return E_UNKNOWN;
+          }
+        }
+        ret = read_block(data_block, view->copy+i*BLOCK_SIZE);
+        data = view->copy+i*BLOCK_SIZE;
+      }
+      if(ret<0){
+        jfs_release_view(view);
+        return ret==RAW_E_CHECKSUM ? E_CHECKSUM : E_UNKNOWN;
+      }
+      struct iovec* last = view->iovcnt>0 ? &view->iov[view->iovcnt-1] : NULL;
+      if(last!=NULL && (const char*)last->iov_base+last->iov_len==data){
+        last->iov_len += len;
+      }
+      else{
+        view->iov[view->iovcnt].iov_base = (void*)data;
+        view->iov[view->iovcnt].iov_len = len;
+        view->iovcnt++;
+      }
+      view->length += len;
+    }
+    return 0;
+}
+
+/* jfs_release_view
+ *   releases a view filled in by jfs_read_view(); its data must not be used
+ *   afterwards
+ * view - the view to release
+ */
+void jfs_release_view(struct jfs_view* view) {
+    for(int i=0; i<view->num_pinned; i++){
+      raw_unpin_block(view->pinned[i]);
+    }
+    free(view->copy);
+    bzero(view, sizeof(struct jfs_view));
+}
+
+/* jfs_du
+ *   reports how much space a file or directory uses, including everything
+ *   below it; this reads at most two blocks however large the subtree is
+ * path - path of the file or directory to inspect, or NULL for the current
+ *   directory
+ * buf - pointer to a struct usage (already allocated by the caller) where the
+ *   usage will be written
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_CHECKSUM
+ */
+int jfs_du(const char* path, struct usage* buf) {
+    TRACE_CALL(JFS_OP_DU, path, 0);
+    LOCK_FS_SHARED();
+    IN_PATH_DIR(path, name);
+    block_num_t block_num = current_dir;
+    if(name!=NULL){
+      int found = find_block_num_by_name(name);
+      if(found<0){
+        return found;
+      }
+      else if(found==0){
+        return E_NOT_EXISTS;
+      }
+      block_num = found;
+    }
+    return get_usage(block_num, buf);
+}
+
+// reads the usage of a file or directory from its inode or dir block
+static int get_usage(block_num_t block_num, struct usage* buf){
+    struct block diskBlock;
+    int ret = read_jfs_block(block_num, &diskBlock);
+    if(ret<0){
+      return ret;
+    }
+    if(diskBlock.is_dir==1){ // it is a file
+      buf->num_blocks = 1+count_num_data_block(diskBlock.contents.inode.file_size);
+      buf->num_bytes = diskBlock.contents.inode.file_size;
+    }
+    else{ // it is a directory
+      buf->num_blocks = 1+diskBlock.contents.dirnode.subtree_blocks;
+      buf->num_bytes = diskBlock.contents.dirnode.subtree_bytes;
+    }
+    return 0;
+}
+
+// Blocks freed by jfs_remove_tree() are released in batches, so the
+// superblock is rewritten once per batch rather than once per block
+#define RELEASE_BATCH_SIZE 64
+struct release_batch {
+    block_num_t blocks[RELEASE_BATCH_SIZE];
+    int count;
+};
+
+static void flush_release_batch(struct release_batch* batch){
+    release_blocks(batch->blocks, batch->count);
+    for(int i=0; i<batch->count; i++){
+      if(block_ref_count(batch->blocks[i])==0){
+        meta_drop(batch->blocks[i]);
+      }
+    }
+    // data blocks that were freed can no longer be shared by dedup
+    for(int i=0; i<batch->count; i++){
+      if(dedup_indexed[batch->blocks[i]] && block_ref_count(batch->blocks[i])==0){
+        dedup_remove(batch->blocks[i]);
+      }
+    }
+    batch->count = 0;
+}
+
+static void add_to_release_batch(struct release_batch* batch, block_num_t block_num){
+    if(batch->count==RELEASE_BATCH_SIZE){
+      flush_release_batch(batch);
+    }
+    batch->blocks[batch->count++] = block_num;
+}
+
+// adds a file or directory, and everything below it, to the release batch
+// (only the block itself if it is shared: what it points to stays with the
+// other owners)
+static void release_tree(block_num_t block_num, struct release_batch* batch){
+    struct block diskBlock;
+    if(block_ref_count(block_num)==1 && read_jfs_block(block_num, &diskBlock)==0){
+      if(diskBlock.is_dir==1){ // it is a file
+        int num_data_blocks = count_num_data_block(diskBlock.contents.inode.file_size);
+        for(int i=0; i<num_data_blocks; i++){
+          add_to_release_batch(batch, diskBlock.contents.inode.data_blocks[i]);
+        }
+      }
+      else{ // it is a directory
+        for(int i=0; i<diskBlock.contents.dirnode.num_entries; i++){
+          release_tree(diskBlock.contents.dirnode.entries[i].block_num, batch);
+        }
+      }
+    }
+    add_to_release_batch(batch, block_num);
+}
+
+/* jfs_remove_tree
+ *   removes the specified file or directory, along with everything below it
+ *   (like rm -r)
+ * path - path of the file or directory to remove
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_INVALID (the path names no entry, or the current
+ *   directory is below it), E_CHECKSUM, E_READ_ONLY
+ */
+int jfs_remove_tree(const char* path) {
+    TRACE_CALL(JFS_OP_REMOVE_TREE, path, 0);
+    LOCK_FS_EXCLUSIVE();
+    IN_PATH_DIR(path, name);
+    if(name==NULL){
+      return E_INVALID;
+    }
+    PREPARE_UPDATE();
+    int block_num = find_block_num_by_name(name);
+    if(block_num<0){
+      return block_num;
+    }
+    else if(block_num==0){
+      return E_NOT_EXISTS;
+    }
+    if(on_cwd_path(block_num)){ // the current directory would be left dangling
+      return E_INVALID;
+    }
+    struct usage removed;
+    int ret = get_usage(block_num, &removed);
+    if(ret<0){
+      return ret;
+    }
+    ret = rm_subdir_or_file_from_current_dir(name);
+    if(ret<0){
+      return ret;
+    }
+    struct release_batch batch;
+    batch.count = 0;
+    release_tree(block_num, &batch);
+    flush_release_batch(&batch);
+    update_subtree_counters(-(int)removed.num_blocks, -(int)removed.num_bytes);
+    path_cache_invalidate();
+    return 0;
+}
+
+#define FIND_PREFIX_LENGTH 256 // longest path prefix jfs_find passes on
+
+// calls fn for the entry at block_num (whose path is in path) and, if it is a
+// directory, for everything below it; depth limits how far down to go
+static int find_tree(block_num_t block_num, char* path, int depth, jfs_find_fn fn, void* arg){
+    struct block diskBlock;
+    int ret = read_jfs_block(block_num, &diskBlock);
+    if(ret<0){
+      return ret;
+    }
+    struct stats entry;
+    bzero(&entry, sizeof(entry));
+    const char* base = strrchr(path, '/');
+    strncpy(entry.name, base ? base+1 : path, MAX_NAME_LENGTH);
+    entry.block_num = block_num;
+    entry.is_dir = diskBlock.is_dir;
+    if(diskBlock.is_dir==1){ // it is a file
+      entry.file_size = diskBlock.contents.inode.file_size;
+      entry.num_data_blocks = count_num_data_block(entry.file_size);
+    }
+    ret = fn(path, &entry, arg);
+    if(ret!=0 || diskBlock.is_dir==1 || depth==0){
+      return ret;
+    }
+    size_t len = strlen(path);
+    size_t name_start = len>0 && path[len-1]=='/' ? len : len+1; // don't double the / after the root
+    for(int i=0; i<diskBlock.contents.dirnode.num_entries; i++){
+      path[name_start-1] = '/';
+      memcpy(path+name_start, diskBlock.contents.dirnode.entries[i].name, MAX_NAME_LENGTH+1);
+      ret = find_tree(diskBlock.contents.dirnode.entries[i].block_num, path, depth-1, fn, arg);
+      path[len] = '\0';
+      if(ret!=0){
+        return ret;
+      }
+    }
+    return 0;
+}
+
+/* jfs_find
+ *   walks the specified file or directory and everything below it (depth
+ *   first, parents before children), calling fn for each entry
+ * path - path of the file or directory to start from (the paths passed to fn
+ *   start with it), or NULL to walk the current directory (whose path is
+ *   then ".")
+ * fn - function to call for each entry (see jfs_find_fn)
+ * arg - passed to fn unchanged
+ * returns 0 on success, the non-zero value returned by fn if it stopped the
+ *   walk, or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_CHECKSUM, E_INVALID (path is longer than 255 bytes)
+ */
+int jfs_find(const char* path, jfs_find_fn fn, void* arg) {
+    TRACE_CALL(JFS_OP_FIND, path, 0);
+    LOCK_FS_SHARED();
+    IN_PATH_DIR(path, name);
+    // the paths passed to fn start with the path given
+    char found_path[FIND_PREFIX_LENGTH+(MAX_DIR_DEPTH+2)*(MAX_NAME_LENGTH+1)];
+    block_num_t block_num = current_dir;
+    if(name!=NULL){
+      int found = find_block_num_by_name(name);
+      if(found<0){
+        return found;
+      }
+      else if(found==0){
+        return E_NOT_EXISTS;
+      }
+      block_num = found;
+    }
+    if(path==NULL){
+      strcpy(found_path, ".");
+    }
+    else{
+      size_t len = strlen(path);
+      if(len>=FIND_PREFIX_LENGTH){
+        return E_INVALID;
+      }
+      while(len>1 && path[len-1]=='/'){
+        len--;
+      }
+      memcpy(found_path, path, len);
+      found_path[len] = '\0';
+    }
+    return find_tree(block_num, found_path, MAX_DIR_DEPTH, fn, arg);
+}
+
+// number of runs of consecutive blocks that a file's data is split into
+static uint32_t count_extents(const struct block* inode){
+    int num_data_blocks = count_num_data_block(inode->contents.inode.file_size);
+    uint32_t extents = 0;
+    for(int i=0; i<num_data_blocks; i++){
+      if(i==0 || inode->contents.inode.data_blocks[i]!=inode->contents.inode.data_blocks[i-1]+1){
+        extents++;
+      }
+    }
+    return extents;
+}
+
+// gives back the run of blocks a file was being moved into, when the move is
+// abandoned
+static void abandon_move(block_num_t run, int count, uint32_t extents, struct defrag_stats* stats){
+    block_num_t blocks[1+MAX_DATA_BLOCKS];
+    for(int i=0; i<count; i++){
+      blocks[i] = run+i;
+    }
+    release_blocks(blocks, count);
+    meta_drop(run);
+    stats->files_skipped++;
+    stats->extents_after += extents;
+}
+
+// relocates the file at entry `entry` of the directory dirBlock (stored in
+// block dir_num) so that its inode directly follows the directory block as
+// closely as possible and its data directly follows its inode
+static void defrag_file(block_num_t dir_num, struct block* dirBlock, int entry, struct defrag_stats* stats){
+    block_num_t inode_num = dirBlock->contents.dirnode.entries[entry].block_num;
+    struct block inode;
+    if(read_jfs_block(inode_num, &inode)<0){
+      return;
+    }
+    int num_data_blocks = count_num_data_block(inode.contents.inode.file_size);
+    block_num_t* data_blocks = inode.contents.inode.data_blocks;
+    stats->files_examined++;
+    uint32_t extents = meta_nodes[inode_num]!=NULL ? (uint32_t)meta_nodes[inode_num]->num_extents : count_extents(&inode);
+    stats->extents_before += extents;
+
+    // a file already laid out as inode followed by its data is left alone
+    if(num_data_blocks==0 || (extents==1 && data_blocks[0]==inode_num+1)){
+      stats->extents_after += extents;
+      return;
+    }
+    // blocks shared with other files (or snapshots) can't move without
+    // unsharing them
+    bool_t shared = block_ref_count(inode_num)!=1;
+    for(int i=0; i<num_data_blocks && !shared; i++){
+      shared = block_ref_count(data_blocks[i])!=1;
+    }
+    block_num_t run = shared ? 0 : allocate_contiguous(1+num_data_blocks, dir_num);
+    if(run==0){
+      stats->files_skipped++;
+      stats->extents_after += extents;
+      return;
+    }
+
+    // copy the data into the new run
+    char data[MAX_DATA_BLOCKS*BLOCK_SIZE];
+    block_num_t new_blocks[MAX_DATA_BLOCKS];
+    raw_prefetch(data_blocks, num_data_blocks);
+    for(int i=0; i<num_data_blocks; i++){
+      if(read_block(data_blocks[i], data+i*BLOCK_SIZE)<0){ // leave damaged files where they are
+        abandon_move(run, 1+num_data_blocks, extents, stats);
+        return;
+      }
+      new_blocks[i] = run+1+i;
+    }
+    if(write_jfs_blocks(new_blocks, num_data_blocks, data)<0){
+      abandon_move(run, 1+num_data_blocks, extents, stats);
+      return;
+    }
+
+    // write the new inode, then switch the directory entry over to it; the
+    // file only changes on disk with that single block write, so it is never
+    // seen half moved
+    block_num_t old_blocks[1+MAX_DATA_BLOCKS];
+    old_blocks[0] = inode_num;
+    memcpy(old_blocks+1, data_blocks, num_data_blocks*sizeof(block_num_t));
+    memcpy(data_blocks, new_blocks, num_data_blocks*sizeof(block_num_t));
+    if(write_jfs_block(run, &inode)<0){
+      memcpy(data_blocks, old_blocks+1, num_data_blocks*sizeof(block_num_t));
+      abandon_move(run, 1+num_data_blocks, extents, stats);
+      return;
+    }
+    meta_insert(run, &inode);
+    dirBlock->contents.dirnode.entries[entry].block_num = run;
+    if(write_jfs_block(dir_num, dirBlock)<0){
+      dirBlock->contents.dirnode.entries[entry].block_num = inode_num;
+      memcpy(data_blocks, old_blocks+1, num_data_blocks*sizeof(block_num_t));
+      abandon_move(run, 1+num_data_blocks, extents, stats);
+      return;
+    }
+
+    // the old blocks are garbage now
+    release_blocks(old_blocks, 1+num_data_blocks);
+    meta_drop(inode_num);
+    for(int i=0; i<num_data_blocks; i++){
+      if(dedup_indexed[old_blocks[1+i]]){
+        dedup_remove(old_blocks[1+i]);
+        dedup_insert(new_blocks[i], data+i*BLOCK_SIZE);
+      }
+    }
+    stats->files_moved++;
+    stats->blocks_moved += 1+num_data_blocks;
+    stats->extents_after += 1;
+}
+
+static void defrag_tree(block_num_t dir_num, struct defrag_stats* stats){
+    struct block dirBlock;
+    if(read_jfs_block(dir_num, &dirBlock)<0){
+      return;
+    }
+    for(int i=0; i<dirBlock.contents.dirnode.num_entries; i++){
+      block_num_t child = dirBlock.contents.dirnode.entries[i].block_num;
+      if(entry_is_dir(&dirBlock, i)){
+        if(block_ref_count(child)==1){ // (snapshots are left as they are)
+          defrag_tree(child, stats);
+        }
+      }
+      else{
+        defrag_file(dir_num, &dirBlock, i, stats);
+      }
+    }
+}
+
+/* jfs_defrag
+ *   defragments the whole file system: every file's data is moved into one
+ *   run of consecutive blocks, directly after the file's inode, which is
+ *   itself placed as close after its directory's block as possible; this
+ *   lets readahead and batched writes transfer a file in a single request
+ *   (directory blocks, and blocks shared between files or with snapshots, are
+ *   not moved)
+ * buf - pointer to a struct defrag_stats (already allocated by the caller)
+ *   where the results will be written
+ * returns 0 (individual files that can't be moved are just skipped), or
+ *   E_READ_ONLY
+ */
+int jfs_defrag(struct defrag_stats* buf) {
+    TRACE_CALL(JFS_OP_DEFRAG, NULL, 0);
+    LOCK_FS_EXCLUSIVE();
+    bzero(buf, sizeof(struct defrag_stats));
+    PREPARE_UPDATE();
+    defrag_tree(dir_path[0], buf);
+    return 0;
+}
+
+// adds an entry to an in-memory directory block
+static void add_entry(struct block* dirBlock, const char* name, block_num_t block_num, bool_t is_dir){
+    int i = dirBlock->contents.dirnode.num_entries++;
+    dirBlock->contents.dirnode.entries[i].block_num = block_num;
+    bzero(dirBlock->contents.dirnode.entries[i].name, MAX_NAME_LENGTH+1);
+    memcpy(dirBlock->contents.dirnode.entries[i].name, name, strlen(name));
+    set_entry_type(dirBlock, i, is_dir);
+}
+
+// whether an in-memory directory block has an entry with this name
+static bool_t has_entry(const struct block* dirBlock, const char* name){
+    for(int i=0; i<dirBlock->contents.dirnode.num_entries; i++){
+      if(!strncmp(dirBlock->contents.dirnode.entries[i].name, name, MAX_NAME_LENGTH+1)){
+        return TRUE;
+      }
+    }
+    return FALSE;
+}
+
+// copies a host file into a new file: the inode and its data are allocated
+// as one contiguous run if there is one (block by block near `near` if not)
+// and written with a single batched write
+// file_size - set to the number of bytes read from the host file
+// returns the inode's block number, or 0 if the file could not be imported
+static block_num_t import_file(const char* host_path, block_num_t near, struct transfer_stats* stats,
+                               uint32_t* file_size){
+    int fd = open(host_path, O_RDONLY);
+    if(fd<0){
+      return 0;
+    }
+    // the run is read in as [inode][data...], with room to detect oversized files
+    char run_data[(1+MAX_DATA_BLOCKS)*BLOCK_SIZE+1];
+    bzero(run_data, sizeof(run_data));
+    ssize_t size = 0;
+    ssize_t ret;
+    while((ret = read(fd, run_data+BLOCK_SIZE+size, sizeof(run_data)-BLOCK_SIZE-size))>0){
+      size += ret;
+    }
+    close(fd);
+    if(ret<0 || size>(ssize_t)MAX_FILE_SIZE){
+      return 0;
+    }
+    int num_data_blocks = count_num_data_block(size);
+    block_num_t run_blocks[1+MAX_DATA_BLOCKS];
+    block_num_t run = allocate_contiguous(1+num_data_blocks, near);
+    if(run!=0){
+      for(int i=0; i<=num_data_blocks; i++){
+        run_blocks[i] = run+i;
+      }
+    }
+    else{
+      // no run that long is free (the disk may just be fragmented)
+      for(int i=0; i<=num_data_blocks; i++){
+        run_blocks[i] = allocate_block_near(i==0 ? near : run_blocks[i-1]);
+        if(run_blocks[i]==0){
+          release_blocks(run_blocks, i);
+          return 0;
+        }
+      }
+    }
+    struct block* inode = (struct block*) run_data;
+    inode->is_dir = 1;
+    inode->contents.inode.file_size = size;
+    memcpy(inode->contents.inode.data_blocks, run_blocks+1, num_data_blocks*sizeof(block_num_t));
+    if(write_jfs_blocks(run_blocks, 1+num_data_blocks, run_data)<0){
+      release_blocks(run_blocks, 1+num_data_blocks);
+      return 0;
+    }
+    meta_insert(run_blocks[0], inode);
+    // (only blocks that made it to disk are indexed)
+    for(int i=0; i<num_data_blocks && dedup_enabled; i++){
+      if((i+1)*BLOCK_SIZE<=size){
+        dedup_insert(run_blocks[1+i], run_data+(1+i)*BLOCK_SIZE);
+      }
+    }
+    stats->files++;
+    stats->bytes += size;
+    *file_size = size;
+    return run_blocks[0];
+}
+
+// copies the contents of a host directory into the in-memory directory block
+// dirBlock (stored in block dir_num), which the caller writes afterwards;
+// every subdirectory created is written once, after all its children
+// levels - how many levels of subdirectories may still be created below
+//   dir_num without going past MAX_DIR_DEPTH
+// returns 0, or -1 (with nothing imported) if host_path can't be opened
+static int import_dir(const char* host_path, block_num_t dir_num, struct block* dirBlock, int levels,
+                      struct transfer_stats* stats, struct usage* added){
+    DIR* host_dir = opendir(host_path);
+    if(host_dir==NULL){
+      return -1;
+    }
+    struct dirent* host_entry;
+    while((host_entry = readdir(host_dir))!=NULL){
+      const char* name = host_entry->d_name;
+      if(!strcmp(name, ".") || !strcmp(name, "..")){
+        continue;
+      }
+      if(strlen(name)>MAX_NAME_LENGTH || has_entry(dirBlock, name) ||
+         dirBlock->contents.dirnode.num_entries>=MAX_DIR_ENTRIES){
+        stats->skipped++;
+        continue;
+      }
+      char child_path[PATH_MAX];
+      struct stat host_stat;
+      snprintf(child_path, sizeof(child_path), "%s/%s", host_path, name);
+      if(lstat(child_path, &host_stat)<0){
+        stats->skipped++;
+      }
+      else if(S_ISDIR(host_stat.st_mode)){
+        block_num_t child_num = levels>0 ? allocate_contiguous(1, dir_num) : 0;
+        if(child_num==0){
+          stats->skipped++;
+          continue;
+        }
+        struct block child;
+        struct usage child_added;
+        bzero(&child, sizeof(child));
+        bzero(&child_added, sizeof(child_added));
+        if(import_dir(child_path, child_num, &child, levels-1, stats, &child_added)<0){
+          release_block(child_num);
+          stats->skipped++;
+          continue;
+        }
+        child.contents.dirnode.subtree_blocks = child_added.num_blocks;
+        child.contents.dirnode.subtree_bytes = child_added.num_bytes;
+        if(write_jfs_block(child_num, &child)==0){
+          meta_insert(child_num, &child);
+        }
+        add_entry(dirBlock, name, child_num, TRUE);
+        stats->directories++;
+        added->num_blocks += 1+child_added.num_blocks;
+        added->num_bytes += child_added.num_bytes;
+      }
+      else if(S_ISREG(host_stat.st_mode)){
+        uint32_t file_size;
+        block_num_t inode_num = import_file(child_path, dir_num, stats, &file_size);
+        if(inode_num==0){
+          stats->skipped++;
+          continue;
+        }
+        add_entry(dirBlock, name, inode_num, FALSE);
+        added->num_blocks += 1+count_num_data_block(file_size);
+        added->num_bytes += file_size;
+      }
+      else{ // symlinks, devices, ... have no equivalent here
+        stats->skipped++;
+      }
+    }
+    closedir(host_dir);
+    return 0;
+}
+
+/* jfs_import
+ *   copies the contents of a directory tree on the _real_ file system into
+ *   the current directory, in one pass: each file's inode and data are
+ *   allocated together as one contiguous run (or, on a fragmented disk,
+ *   block by block close together) and written with one batched write, and
+ *   each directory block is written once, after all its children
+ * host_path - the directory on the _real_ file system to copy from
+ * buf - pointer to a struct transfer_stats (already allocated by the caller)
+ *   where the results will be written; entries that don't fit (names longer
+ *   than MAX_NAME_LENGTH, directories with more than MAX_DIR_ENTRIES entries
+ *   or that would be nested deeper than MAX_DIR_DEPTH, files larger than
+ *   MAX_FILE_SIZE, names that already exist, anything but regular files and
+ *   directories, anything that can't be opened, or running out of disk
+ *   space) are skipped and counted in buf->skipped
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS (host_path can't be opened as a directory), E_CHECKSUM,
+ *   E_READ_ONLY
+ */
+int jfs_import(const char* host_path, struct transfer_stats* buf) {
+    LOCK_FS_EXCLUSIVE();
+    bzero(buf, sizeof(struct transfer_stats));
+    PREPARE_UPDATE();
+    struct block dirBlock;
+    int ret = read_jfs_block(current_dir, &dirBlock);
+    if(ret<0){
+      return ret;
+    }
+    struct usage added;
+    bzero(&added, sizeof(added));
+    if(import_dir(host_path, current_dir, &dirBlock, MAX_DIR_DEPTH-dir_depth, buf, &added)<0){
+      return E_NOT_EXISTS;
+    }
+    write_jfs_block(current_dir, &dirBlock);
+    update_subtree_counters(added.num_blocks, added.num_bytes);
+    return 0;
+}
+
+// copies a file out to the _real_ file system
+static void export_file(block_num_t inode_num, const char* host_path, struct transfer_stats* stats){
+    struct block inode;
+    char data[MAX_FILE_SIZE];
+    if(read_jfs_block(inode_num, &inode)<0){
+      stats->skipped++;
+      return;
+    }
+    uint32_t file_size = inode.contents.inode.file_size;
+    int num_data_blocks = count_num_data_block(file_size);
+    raw_prefetch(inode.contents.inode.data_blocks, num_data_blocks);
+    for(int i=0; i<num_data_blocks; i++){
+      if(read_block(inode.contents.inode.data_blocks[i], data+i*BLOCK_SIZE)<0){
+        stats->skipped++;
+        return;
+      }
+    }
+    int fd = open(host_path, O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if(fd<0){
+      stats->skipped++;
+      return;
+    }
+    if(write(fd, data, file_size)!=(ssize_t)file_size){
+      stats->skipped++;
+    }
+    else{
+      stats->files++;
+      stats->bytes += file_size;
+    }
+    close(fd);
+}
+
+// copies a directory and everything below it out to the _real_ file system
+static void export_dir(block_num_t dir_num, const char* host_path, struct transfer_stats* stats){
+    struct block dirBlock;
+    if(read_jfs_block(dir_num, &dirBlock)<0 ||
+       (mkdir(host_path, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH)<0 && errno!=EEXIST)){
+      stats->skipped++;
+      return;
+    }
+    stats->directories++;
+    for(int i=0; i<dirBlock.contents.dirnode.num_entries; i++){
+      char child_path[PATH_MAX];
+      snprintf(child_path, sizeof(child_path), "%s/%s", host_path, dirBlock.contents.dirnode.entries[i].name);
+      if(entry_is_dir(&dirBlock, i)){
+        export_dir(dirBlock.contents.dirnode.entries[i].block_num, child_path, stats);
+      }
+      else{
+        export_file(dirBlock.contents.dirnode.entries[i].block_num, child_path, stats);
+      }
+    }
+}
+
+/* jfs_export
+ *   copies a file or directory tree out to the _real_ file system
+ * path - path of the file or directory to copy, or NULL to copy the current
+ *   directory itself
+ * host_path - path on the _real_ file system to copy it to; directories are
+ *   created as needed and existing files are overwritten
+ * buf - pointer to a struct transfer_stats (already allocated by the caller)
+ *   where the results will be written; entries that could not be read or
+ *   written are counted in buf->skipped
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS
+ */
+int jfs_export(const char* path, const char* host_path, struct transfer_stats* buf) {
+    LOCK_FS_SHARED();
+    IN_PATH_DIR(path, name);
+    bzero(buf, sizeof(struct transfer_stats));
+    block_num_t block_num = current_dir;
+    if(name!=NULL){
+      int found = find_block_num_by_name(name);
+      if(found<0){
+        return found;
+      }
+      else if(found==0){
+        return E_NOT_EXISTS;
+      }
+      block_num = found;
+    }
+    int ret = is_dir(block_num);
+    if(ret<0){
+      return ret;
+    }
+    else if(ret){
+      export_dir(block_num, host_path, buf);
+    }
+    else{
+      export_file(block_num, host_path, buf);
+    }
+    return 0;
+}
+
+/* jfs_rename
+ *   renames a file or directory, or moves it to another directory, by
+ *   rewriting only the directory blocks involved: the data of a file, or the
+ *   contents of a directory, are not read or written
+ * src - path of the file or directory to rename
+ * dst - where to put it: a path naming the new entry, or an existing
+ *   directory (e.g. "..", "/", "dir" or "dir/") to move src into under the
+ *   same name; if the destination name is an existing file and src is a file
+ *   too, the existing file is replaced
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_EXISTS (the destination name is a directory), E_NOT_DIR
+ *   (src is a directory and the destination name is a file),
+ *   E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES, E_MAX_DIR_DEPTH, E_INVALID (moving
+ *   a directory into itself, or a path that names no entry as src),
+ *   E_CHECKSUM, E_READ_ONLY
+ */
+int jfs_rename(const char* src, const char* dst) {
+    TRACE_CALL_2(JFS_OP_RENAME, src, dst);
+    LOCK_FS_EXCLUSIVE();
+    struct working_dir* caller_op_dir __attribute__((cleanup(restore_op_dir))) = op_dir;
+    struct working_dir src_dir, dst_dir;
+    char src_name[MAX_NAME_LENGTH+2];
+    char name[MAX_NAME_LENGTH+2];
+    int ret = resolve_path(src, &src_dir, src_name);
+    if(ret<0){
+      return ret;
+    }
+    if(src_name[0]=='\0'){
+      return E_INVALID;
+    }
+    ret = resolve_path(dst, &dst_dir, name);
+    if(ret<0){
+      return ret;
+    }
+    // unshare both paths; where they overlap, the second one follows the
+    // blocks the first one moved
+    op_dir = &dst_dir;
+    PREPARE_UPDATE();
+    op_dir = &src_dir;
+    PREPARE_UPDATE();
+
+    // work out the target directory and name
+    struct block targetDir;
+    ret = read_jfs_block(dst_dir.path[dst_dir.depth], &targetDir);
+    if(ret<0){
+      return ret;
+    }
+    int dir_index = name[0]!='\0' ? find_entry(&targetDir, name) : -1;
+    bool_t names_src = dst_dir.path[dst_dir.depth]==current_dir && !strcmp(name, src_name);
+    if(name[0]=='\0' || (dir_index>=0 && entry_is_dir(&targetDir, dir_index) && !names_src)){
+      if(name[0]!='\0'){ // into a subdirectory of the target directory
+        if(dst_dir.depth==MAX_DIR_DEPTH){
+          return E_MAX_DIR_DEPTH;
+        }
+        block_num_t dir_num = unshare_entry(dst_dir.path[dst_dir.depth], dir_index);
+        if(dir_num==0){
+          return E_DISK_FULL;
+        }
+        dst_dir.path[++dst_dir.depth] = dir_num;
+        ret = read_jfs_block(dir_num, &targetDir);
+        if(ret<0){
+          return ret;
+        }
+      }
+      strcpy(name, src_name);
+    }
+    if(strlen(name)>MAX_NAME_LENGTH){
+      return E_MAX_NAME_LENGTH;
+    }
+    block_num_t target_num = dst_dir.path[dst_dir.depth];
+    bool_t same_dir = target_num==current_dir;
+
+    struct block srcDir;
+    ret = read_jfs_block(current_dir, &srcDir);
+    if(ret<0){
+      return ret;
+    }
+    int src_index = find_entry(&srcDir, src_name);
+    if(src_index<0){
+      return E_NOT_EXISTS;
+    }
+    block_num_t src_num = srcDir.contents.dirnode.entries[src_index].block_num;
+    bool_t src_is_dir = entry_is_dir(&srcDir, src_index);
+    if(same_dir){
+      targetDir = srcDir;
+    }
+    int dst_index = find_entry(&targetDir, name);
+    if(same_dir && dst_index==src_index){
+      return 0; // renamed to itself
+    }
+    // where the current directory is inside src, its path changes with it
+    int cwd_index = 0;
+    if(src_is_dir){
+      for(int depth=0; depth<=dst_dir.depth; depth++){
+        if(dst_dir.path[depth]==src_num){
+          return E_INVALID;
+        }
+      }
+      while(cwd_index<=cwd.depth && cwd.path[cwd_index]!=src_num){
+        cwd_index++;
+      }
+      if(cwd_index<=cwd.depth && dst_dir.depth+1+cwd.depth-cwd_index>MAX_DIR_DEPTH){
+        return E_MAX_DIR_DEPTH;
+      }
+    }
+    struct usage replaced;
+    bzero(&replaced, sizeof(replaced));
+    if(dst_index>=0){
+      if(entry_is_dir(&targetDir, dst_index)){
+        return E_EXISTS;
+      }
+      if(src_is_dir){
+        return E_NOT_DIR;
+      }
+    }
+    else if(targetDir.contents.dirnode.num_entries>=MAX_DIR_ENTRIES){
+      return E_MAX_DIR_ENTRIES;
+    }
+    struct usage moved;
+    ret = get_usage(src_num, &moved);
+    if(ret<0){
+      return ret;
+    }
+    if(dst_index>=0){
+      // the file being replaced goes away
+      release_file(targetDir.contents.dirnode.entries[dst_index].block_num, &replaced);
+    }
+
+    if(same_dir){
+      // a plain rename: one directory block changes
+      if(dst_index>=0){
+        targetDir.contents.dirnode.entries[dst_index].block_num = src_num;
+        write_jfs_block(current_dir, &targetDir);
+        rm_subdir_or_file_from_current_dir(src_name);
+      }
+      else{
+        bzero(targetDir.contents.dirnode.entries[src_index].name, MAX_NAME_LENGTH+1);
+        memcpy(targetDir.contents.dirnode.entries[src_index].name, name, strlen(name));
+        write_jfs_block(current_dir, &targetDir);
+      }
+      if(replaced.num_blocks>0){
+        update_subtree_counters(-replaced.num_blocks, -replaced.num_bytes);
+      }
+    }
+    else{
+      // a move: link src into the target directory first, so that a crash in
+      // between leaves it in both directories rather than in neither
+      if(dst_index>=0){
+        targetDir.contents.dirnode.entries[dst_index].block_num = src_num;
+      }
+      else{
+        add_entry(&targetDir, name, src_num, src_is_dir);
+      }
+      write_jfs_block(target_num, &targetDir);
+      rm_subdir_or_file_from_current_dir(src_name);
+      // the directories above src lose it, and those above the target gain
+      // it (and lose a replaced file); the ones above both come out even
+      update_subtree_counters(-moved.num_blocks, -moved.num_bytes);
+      op_dir = &dst_dir;
+      update_subtree_counters(moved.num_blocks-replaced.num_blocks, moved.num_bytes-replaced.num_bytes);
+    }
+
+    if(src_is_dir){
+      path_cache_invalidate();
+      if(cwd_index<=cwd.depth){
+        struct working_dir moved_cwd = dst_dir;
+        for(int depth=cwd_index; depth<=cwd.depth; depth++){
+          moved_cwd.path[++moved_cwd.depth] = cwd.path[depth];
+        }
+        cwd = moved_cwd;
+      }
+    }
+    return 0;
+}
+
+/* jfs_disk_stats
+ *   reports the disk I/O counters (reads, writes, and blocks that failed
+ *   checksum verification) accumulated since the file system was mounted
+ * buf - pointer to a struct raw_stats (already allocated by the caller) where
+ *   the counters will be written
+ * returns 0 (this function always succeeds)
+ */
+int jfs_disk_stats(struct raw_stats* buf) {
+    raw_get_stats(buf);
+    return 0;
+}
+
+/* jfs_sync
+ *   flushes every change made so far (by calls that have returned) to stable
+ *   storage, whatever the mount's durability policy
+ * returns 0 on success or E_UNKNOWN if the host failed to flush the data
+ */
+int jfs_sync() {
+    TRACE_CALL(JFS_OP_SYNC, NULL, 0);
+    LOCK_FS_SHARED();
+    return raw_sync()<0 ? E_UNKNOWN : 0;
+}
+
+/* jfs_checkpoint
+ *   marks a point in time for incremental backups: the blocks changed from
+ *   now on can later be exported on their own (see ./backup)
+ * returns the checkpoint's number, or 0 on failure
+ */
+uint32_t jfs_checkpoint() {
+    TRACE_CALL(JFS_OP_CHECKPOINT, NULL, 0);
+    LOCK_FS_EXCLUSIVE();
+    return raw_checkpoint();
+}
+
+/* jfs_snapshot_create
+ *   takes a read-only snapshot of the whole file system, which can later be
+ *   mounted (see struct mount_options); this only records the root
+ *   directory's block, so it takes the same time whatever the size of the
+ *   file system, and blocks are only copied as the live file system changes
+ * name - name to give the snapshot
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_EXISTS, E_MAX_NAME_LENGTH, E_MAX_SNAPSHOTS, E_READ_ONLY
+ */
+int jfs_snapshot_create(const char* name) {
+    TRACE_CALL(JFS_OP_SNAPSHOT_CREATE, name, 0);
+    LOCK_FS_EXCLUSIVE();
+    if(read_only){
+      return E_READ_ONLY;
+    }
+    if(strlen(name)>MAX_NAME_LENGTH){
+      return E_MAX_NAME_LENGTH;
+    }
+    if(find_snapshot(name)>=0){
+      return E_EXISTS;
+    }
+    int i = 0;
+    while(i<MAX_SNAPSHOTS && snapshots[i].root!=0){
+      i++;
+    }
+    if(i==MAX_SNAPSHOTS){
+      return E_MAX_SNAPSHOTS;
+    }
+    if(share_block(1)<0){
+      return E_UNKNOWN;
+    }
+    bzero(&snapshots[i], sizeof(struct snapshot_entry));
+    memcpy(snapshots[i].name, name, strlen(name));
+    snapshots[i].root = 1;
+    snapshots[i].created = time(NULL);
+    return store_snapshots()<0 ? E_UNKNOWN : 0;
+}
+
+/* jfs_snapshot_delete
+ *   deletes a snapshot, freeing the blocks that only it was using
+ * name - name of the snapshot to delete
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_READ_ONLY
+ */
+int jfs_snapshot_delete(const char* name) {
+    TRACE_CALL(JFS_OP_SNAPSHOT_DELETE, name, 0);
+    LOCK_FS_EXCLUSIVE();
+    if(read_only){
+      return E_READ_ONLY;
+    }
+    int i = find_snapshot(name);
+    if(i<0){
+      return E_NOT_EXISTS;
+    }
+    struct release_batch batch;
+    batch.count = 0;
+    release_tree(snapshots[i].root, &batch);
+    flush_release_batch(&batch);
+    bzero(&snapshots[i], sizeof(struct snapshot_entry));
+    return store_snapshots()<0 ? E_UNKNOWN : 0;
+}
+
+/* jfs_snapshot_list
+ *   lists the snapshots held by the image
+ * buf - array (allocated by the caller) where the snapshots will be written
+ * max - size of the buf array
+ * returns the number of snapshots written to buf
+ */
+int jfs_snapshot_list(struct jfs_snapshot* buf, int max) {
+    TRACE_CALL(JFS_OP_SNAPSHOT_LIST, NULL, 0);
+    LOCK_FS_SHARED();
+    int count = 0;
+    for(int i=0; i<MAX_SNAPSHOTS && count<max; i++){
+      if(snapshots[i].root!=0){
+        bzero(&buf[count], sizeof(struct jfs_snapshot));
+        memcpy(buf[count].name, snapshots[i].name, MAX_NAME_LENGTH);
+        buf[count].created = snapshots[i].created;
+        count++;
+      }
+    }
+    return count;
+}
+
+
+// Asynchronous requests are queued and run by a pool of worker threads that
+// is started by the first submission.  Each request runs in the directory
+// that was current when it was submitted.  Requests run concurrently (as far
+// as fs_lock allows), so a request that depends on another one should only
+// be submitted after the other one has completed.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t submitted; // signalled when a request is queued
+    pthread_cond_t completed; // signalled when a request completes
+    struct jfs_request *pending_head, *pending_tail; // waiting for a worker
+    struct jfs_request *done_head, *done_tail;       // waiting for jfs_async_reap()
+    int in_flight;   // submitted but not yet reaped (or called back)
+    int num_workers; // 0 until the pool is started
+    int shutdown;
+    pthread_t workers[MAX_ASYNC_WORKERS];
+} async_queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                  PTHREAD_COND_INITIALIZER, NULL, NULL, NULL, NULL, 0, 0, 0, {0} };
+static void run_request(struct jfs_request* req){
+    struct working_dir dir;
+    memcpy(dir.path, req->cwd_path, sizeof(dir.path));
+    dir.depth = req->cwd_depth;
+    op_dir = &dir;
+    switch(req->op){
+      case JFS_OP_CREAT:
+        req->result = jfs_creat(req->name);
+        break;
+      case JFS_OP_REMOVE:
+        req->result = jfs_remove(req->name);
+        break;
+      case JFS_OP_STAT:
+        req->result = jfs_stat(req->name, req->buf);
+        break;
+      case JFS_OP_WRITE:
+        req->result = jfs_write(req->name, req->buf, req->count);
+        break;
+      case JFS_OP_READ:
+        req->result = jfs_read(req->name, req->buf, &req->count);
+        break;
+      default:
+        req->result = E_UNKNOWN;
+    }
+    op_dir = NULL;
+}
+
+static void* async_worker(void* arg){
+    (void) arg;
+    pthread_mutex_lock(&async_queue.lock);
+    for(;;){
+      while(!async_queue.shutdown && async_queue.pending_head==NULL){
+        pthread_cond_wait(&async_queue.submitted, &async_queue.lock);
+      }
+      if(async_queue.pending_head==NULL){ // shutting down, and nothing left to run
+        break;
+      }
+      struct jfs_request* req = async_queue.pending_head;
+      async_queue.pending_head = req->next;
+      if(async_queue.pending_head==NULL){
+        async_queue.pending_tail = NULL;
+      }
+      pthread_mutex_unlock(&async_queue.lock);
+
+      run_request(req);
+
+      if(req->callback!=NULL){
+        pthread_mutex_lock(&async_queue.lock);
+        async_queue.in_flight--;
+        pthread_cond_broadcast(&async_queue.completed);
+        pthread_mutex_unlock(&async_queue.lock);
+        req->callback(req); // the caller may free req now
+        pthread_mutex_lock(&async_queue.lock);
+      }
+      else{
+        pthread_mutex_lock(&async_queue.lock);
+        req->next = NULL;
+        if(async_queue.done_tail==NULL){
+          async_queue.done_head = req;
+        }
+        else{
+          async_queue.done_tail->next = req;
+        }
+        async_queue.done_tail = req;
+        uint64_t one = 1;
+        if(write(async_event_fd, &one, sizeof(one))<0){
+          // the counter can only overflow if nobody ever reaps; nothing to do
+        }
+        pthread_cond_broadcast(&async_queue.completed);
+      }
+    }
+    pthread_mutex_unlock(&async_queue.lock);
+    return NULL;
+}
+
+// queues a request whose op and arguments are filled in
+static int submit_request(struct jfs_request* req){
+    { // remember which directory the request runs in
+      LOCK_FS_SHARED();
+      memcpy(req->cwd_path, dir_path, sizeof(req->cwd_path));
+      req->cwd_depth = dir_depth;
+    }
+    req->next = NULL;
+    pthread_mutex_lock(&async_queue.lock);
+    // start the worker pool the first time it is needed
+    while(async_queue.num_workers<async_pool_size){
+      if(pthread_create(&async_queue.workers[async_queue.num_workers], NULL, async_worker, NULL)!=0){
+        break;
+      }
+      async_queue.num_workers++;
+    }
+    if(async_queue.num_workers==0){
+      pthread_mutex_unlock(&async_queue.lock);
+      return E_UNKNOWN;
+    }
+    if(async_queue.pending_tail==NULL){
+      async_queue.pending_head = req;
+    }
+    else{
+      async_queue.pending_tail->next = req;
+    }
+    async_queue.pending_tail = req;
+    async_queue.in_flight++;
+    pthread_cond_signal(&async_queue.submitted);
+    pthread_mutex_unlock(&async_queue.lock);
+    return 0;
+}
+
+// stops the worker pool, after it has run every request already submitted
+static void stop_async_workers(){
+    pthread_mutex_lock(&async_queue.lock);
+    async_queue.shutdown = 1;
+    pthread_cond_broadcast(&async_queue.submitted);
+    pthread_mutex_unlock(&async_queue.lock);
+    for(int i=0; i<async_queue.num_workers; i++){
+      pthread_join(async_queue.workers[i], NULL);
+    }
+    async_queue.num_workers = 0;
+    async_queue.shutdown = 0;
+}
+
+/* jfs_async_creat, jfs_async_remove, jfs_async_stat, jfs_async_write,
+ * jfs_async_read
+ *   submit a request to run jfs_creat, jfs_remove, jfs_stat, jfs_write or
+ *   jfs_read (with the same arguments) on a worker thread, in the current
+ *   directory, and return without waiting for it; when it completes,
+ *   req->result is set to what the synchronous function returned (and for
+ *   read, req->count to the number of bytes read), and then req->callback is
+ *   called or, if it is NULL, req is queued for jfs_async_reap()
+ * req - the request (allocated by the caller, with callback and user_data
+ *   already set); it and all its arguments must stay valid until it completes
+ * returns 0 if the request was submitted, or E_UNKNOWN if it could not be
+ */
+int jfs_async_creat(struct jfs_request* req, const char* path) {
+    req->op = JFS_OP_CREAT;
+    req->name = path;
+    return submit_request(req);
+}
+
+int jfs_async_remove(struct jfs_request* req, const char* path) {
+    req->op = JFS_OP_REMOVE;
+    req->name = path;
+    return submit_request(req);
+}
+
+int jfs_async_stat(struct jfs_request* req, const char* path, struct stats* buf) {
+    req->op = JFS_OP_STAT;
+    req->name = path;
+    req->buf = buf;
+    return submit_request(req);
+}
+
+int jfs_async_write(struct jfs_request* req, const char* path, const void* buf, unsigned short count) {
+    req->op = JFS_OP_WRITE;
+    req->name = path;
+    req->buf = (void*) buf; // only read from
+    req->count = count;
+    return submit_request(req);
+}
+
+int jfs_async_read(struct jfs_request* req, const char* path, void* buf, unsigned short count) {
+    req->op = JFS_OP_READ;
+    req->name = path;
+    req->buf = buf;
+    req->count = count;
+    return submit_request(req);
+}
+
+/* jfs_async_reap
+ *   collects completed requests (the ones submitted without a callback)
+ * completed - array where pointers to the completed requests will be written
+ * max - size of the completed array
+ * wait - if non-zero and no request has completed yet, waits until one does
+ *   (unless no requests are in flight)
+ * returns the number of requests written to completed
+ */
+int jfs_async_reap(struct jfs_request* completed[], int max, int wait) {
+    int count = 0;
+    pthread_mutex_lock(&async_queue.lock);
+    while(wait && async_queue.done_head==NULL && async_queue.in_flight>0){
+      pthread_cond_wait(&async_queue.completed, &async_queue.lock);
+    }
+    while(count<max && async_queue.done_head!=NULL){
+      completed[count++] = async_queue.done_head;
+      async_queue.done_head = async_queue.done_head->next;
+      uint64_t one;
+      if(read(async_event_fd, &one, sizeof(one))<0){
+        // the counter is already in sync
+      }
+    }
+    if(async_queue.done_head==NULL){
+      async_queue.done_tail = NULL;
+    }
+    async_queue.in_flight -= count;
+    pthread_mutex_unlock(&async_queue.lock);
+    return count;
+}
+
+/* jfs_async_event_fd
+ *   returns a file descriptor (an eventfd) that is readable whenever
+ *   completed requests are waiting for jfs_async_reap(), so an event loop can
+ *   poll it alongside its other descriptors; only jfs_async_reap() should
+ *   read from it
+ */
+int jfs_async_event_fd() {
+    return async_event_fd;
+}
+
+
 /* jfs_unmount
  *   makes the file system no longer accessible (unless it is mounted again).
  *   This should be called exactly once after all other jfs_* operations are
@@ -534,6 +3101,18 @@ int jfs_read(const char* file_name, void* buf, unsigned short* ptr_count) {
  *   errors in the underlying disk syscalls.
  */
 int jfs_unmount() {
+  // finish any asynchronous requests that are still queued
+  stop_async_workers();
+  jfs_trace_stop();
+  // flush whatever the flusher hasn't yet
+  stop_flusher();
+  if(durability!=JFS_DURABILITY_NONE){
+    raw_sync();
+  }
+  close(async_event_fd);
+  async_event_fd = -1;
+  meta_unload();
+  meta_enabled = FALSE;
   int ret = bfs_unmount();
   return ret;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define _JUMBO_FILE_SYSTEM_H_
 
 #include "basic_file_system.h"
+#include <sys/uio.h>
 
 
 // maximum number of characters in a file or directory name (not counting '\0')
@@ -16,6 +17,9 @@
 // maximum size (in bytes) that a file can be
 #define MAX_FILE_SIZE (MAX_DATA_BLOCKS * BLOCK_SIZE)
 
+// maximum depth of the current directory below the root directory
+#define MAX_DIR_DEPTH 64
+
 
 // Struct returned by jfs_stat()
 struct stats {
@@ -27,6 +31,134 @@ struct stats {
 };
 
 
+// Struct returned by jfs_du()
+struct usage {
+  uint32_t num_blocks; // blocks used by the file or directory and everything below it
+  uint32_t num_bytes;  // total size (in bytes) of all the files in it
+};
+
+// Struct returned by jfs_defrag()
+struct defrag_stats {
+  uint32_t files_examined;  // regular files looked at
+  uint32_t files_moved;     // files whose inode and data were relocated
+  uint32_t files_skipped;   // fragmented files that could not be relocated (shared blocks, or no free run)
+  uint32_t blocks_moved;    // inode and data blocks copied
+  uint32_t extents_before;  // runs of contiguous data blocks over all files, before defragmenting
+  uint32_t extents_after;   // ... and after
+};
+
+// Struct returned by jfs_import() and jfs_export()
+struct transfer_stats {
+  uint32_t files;       // regular files copied
+  uint32_t directories; // directories created
+  uint32_t bytes;       // file data copied
+  uint32_t skipped;     // entries that could not be copied (see jfs_import/jfs_export)
+};
+
+// maximum number of snapshots an image can hold
+#define MAX_SNAPSHOTS 16
+
+// Struct filled in by jfs_snapshot_list()
+struct jfs_snapshot {
+  char name[MAX_NAME_LENGTH + 1]; // +1 for the '\0' character
+  uint32_t created;               // when it was taken (seconds since the epoch)
+};
+
+// Callback invoked by jfs_find() for each file and directory it visits
+// path - path of the entry relative to the current directory
+// buf - the entry's stats
+// arg - the arg passed to jfs_find()
+// returns 0 to continue the walk, or anything else to stop it (jfs_find()
+//   then returns that value)
+typedef int (*jfs_find_fn)(const char* path, const struct stats* buf, void* arg);
+
+
+// Flags for struct mount_options
+#define JFS_MOUNT_DEDUP     0x1 // share identical full data blocks between (and within) files
+#define JFS_MOUNT_DIRECT_IO 0x2 // bypass the host's page cache (O_DIRECT; see raw_set_direct_io)
+#define JFS_MOUNT_METADATA_CACHE 0x4 // keep all directory blocks and inodes in memory
+#define JFS_MOUNT_EXTENT_ALLOC 0x8 // allocate from a tree of free extents (see bfs_use_extent_tree)
+
+// Durability policies for struct mount_options: when changes are flushed to
+// stable storage (besides explicit jfs_sync() calls)
+#define JFS_DURABILITY_NONE     0 // whenever the host decides to (the default)
+#define JFS_DURABILITY_PERIODIC 1 // by a background thread, every flush_interval_ms
+#define JFS_DURABILITY_SYNC     2 // before each call that changes the file system returns
+#define DEFAULT_FLUSH_INTERVAL_MS 1000
+
+// Struct passed to jfs_mount_with_options()
+struct mount_options {
+  uint32_t flags; // bitwise OR of JFS_MOUNT_* flags
+
+  // if num_stripe_files is non-zero, the disk is striped (RAID-0) across
+  // these image files instead of being stored in the single DISK file
+  const char* const* stripe_files;
+  int num_stripe_files;
+  int stripe_unit; // blocks per stripe unit (a power of 2)
+
+  int num_async_workers; // threads that run jfs_async_* requests (0 for the default)
+
+  int durability;        // JFS_DURABILITY_*
+  int flush_interval_ms; // for JFS_DURABILITY_PERIODIC (0 for the default)
+
+  // if not NULL, mount this snapshot (read-only) instead of the live file system
+  const char* snapshot;
+};
+
+// default number of threads that run jfs_async_* requests
+#define DEFAULT_ASYNC_WORKERS 4
+#define MAX_ASYNC_WORKERS 64
+
+// Operations that can be submitted asynchronously (the first five) and
+// recorded in traces (all of them)
+#define JFS_OP_CREAT       1
+#define JFS_OP_REMOVE      2
+#define JFS_OP_STAT        3
+#define JFS_OP_WRITE       4
+#define JFS_OP_READ        5
+#define JFS_OP_MKDIR       6
+#define JFS_OP_CHDIR       7
+#define JFS_OP_OPENDIR     8
+#define JFS_OP_RMDIR       9
+#define JFS_OP_DU          10
+#define JFS_OP_REMOVE_TREE 11
+#define JFS_OP_FIND        12
+#define JFS_OP_DEFRAG      13
+#define JFS_OP_RENAME      14
+#define JFS_OP_READ_VIEW   15
+#define JFS_OP_SYNC        16
+#define JFS_OP_CHECKPOINT  17
+#define JFS_OP_SNAPSHOT_CREATE 18
+#define JFS_OP_SNAPSHOT_DELETE 19
+#define JFS_OP_SNAPSHOT_LIST   20
+#define JFS_NUM_OPS        21
+
+// An asynchronous request (see jfs_async_*).  The caller owns the struct and
+// everything it points to, and must keep them valid until the request
+// completes.
+struct jfs_request {
+  // filled in by jfs_async_* when the request is submitted
+  int op;              // JFS_OP_*
+  const char* name;    // path of the file (or directory, for stat)
+  void* buf;           // data to write, buffer to read into, or struct stats* for stat
+  unsigned short count;// bytes to write, or size of buf for read (set to the bytes read)
+
+  // filled in when the request completes
+  int result;          // what the synchronous jfs_* function would have returned
+
+  // set by the caller before submitting: if callback is not NULL, it is
+  // called (on a worker thread) when the request completes; otherwise the
+  // request is queued for jfs_async_reap()
+  void (*callback)(struct jfs_request* req);
+  void* user_data;
+
+  // private to the file system
+  struct jfs_request* next;
+  block_num_t cwd_path[MAX_DIR_DEPTH+1]; // the current directory when the request was submitted
+  int cwd_depth;
+};
+
+
 // This is the data stored in an inode or directory block (dirnode)
 struct block {
   uint32_t is_dir; // 0 if it is a directory, 1 if it is a regular file
@@ -43,24 +175,95 @@ struct block {
         block_num_t block_num; // block where the file's inode or directory's dir block is stored
         char name[MAX_NAME_LENGTH + 1]; // +1 for the '\0' character
       } entries[MAX_DIR_ENTRIES];
+      uint8_t entry_types;     // bit i is set if entries[i] is a directory (rather than a regular file)
+      uint8_t flags;           // DIR_* flags
+      uint16_t subtree_blocks; // blocks used by everything below this directory (not counting itself)
+      uint32_t subtree_bytes;  // total size (in bytes) of all files below this directory
     } dirnode;
   } contents;
 };
 
+_Static_assert(sizeof(struct block) == BLOCK_SIZE, "struct block must fill exactly one block");
+
+// Flags for the dirnode flags field
+#define DIR_COUNTERS_VALID 0x1 // set on the root once every subtree_* counter is up to date
+#define DIR_TYPES_VALID 0x2    // set on the root once every entry_types field is up to date
+
+// Struct filled in by jfs_readdir()
+struct jfs_dirent {
+  uint32_t is_dir;                // 0 if it is a directory, 1 if it is a regular file
+  char name[MAX_NAME_LENGTH + 1]; // +1 for the '\0' character
+  block_num_t block_num;          // of the dir block, or the inode (for regular files)
+};
+
+// Directory iterator for jfs_opendir()/jfs_readdir(); allocated by the caller
+// (usually on the stack), and holds a copy of the directory block, so
+// iterating needs no heap allocations or further disk reads
+struct jfs_dir {
+  struct block dir_block;
+  int next; // index of the next entry to return
+};
+
+// A read-only view of a file's data, filled in by jfs_read_view(); allocated
+// by the caller and released with jfs_release_view()
+struct jfs_view {
+  struct iovec iov[MAX_DATA_BLOCKS]; // the data, in order (ready for writev)
+  int iovcnt;
+  uint32_t length;                   // total number of bytes in iov
+
+  // private to jfs_read_view()/jfs_release_view()
+  block_num_t pinned[MAX_DATA_BLOCKS];
+  int num_pinned;
+  char* copy; // blocks that could not be pinned are copied here (usually NULL)
+};
+
 
 // Function comments for all of these are in jumbo_file_system.c
 int jfs_mount (const char* filename);
+int jfs_mount_with_options (const char* filename, const struct mount_options* options);
+int jfs_parse_durability (const char* arg, struct mount_options* options);
 
-int jfs_mkdir (const char* directory_name);
-int jfs_chdir (const char* directory_name);
+int jfs_mkdir (const char* path);
+int jfs_chdir (const char* path);
 int jfs_ls (char* directories[MAX_DIR_ENTRIES+1], char* files[MAX_DIR_ENTRIES+1]);
-int jfs_rmdir (const char* directory_name);
+int jfs_opendir (const char* path, struct jfs_dir* dir);
+int jfs_readdir (struct jfs_dir* dir, struct jfs_dirent* entry);
+int jfs_rmdir (const char* path);
+
+int jfs_creat  (const char* path);
+int jfs_remove (const char* path);
+int jfs_rename (const char* src, const char* dst);
+int jfs_stat   (const char* path, struct stats* buf);
+int jfs_write  (const char* path, const void* buf, unsigned short count);
+int jfs_read   (const char* path, void* buf, unsigned short* ptr_count);
+int jfs_read_view    (const char* path, unsigned short count, struct jfs_view* view);
+void jfs_release_view (struct jfs_view* view);
+
+int jfs_du          (const char* path, struct usage* buf);
+int jfs_remove_tree (const char* path);
+int jfs_find        (const char* path, jfs_find_fn fn, void* arg);
+int jfs_defrag      (struct defrag_stats* buf);
+int jfs_import      (const char* host_path, struct transfer_stats* buf);
+int jfs_export      (const char* path, const char* host_path, struct transfer_stats* buf);
+
+int jfs_snapshot_create (const char* name);
+int jfs_snapshot_delete (const char* name);
+int jfs_snapshot_list   (struct jfs_snapshot* buf, int max);
+
+int jfs_disk_stats (struct raw_stats* buf);
+int jfs_sync       ();
+uint32_t jfs_checkpoint ();
+
+int jfs_trace_start (const char* path);
+int jfs_trace_stop  ();
 
-int jfs_creat  (const char* file_name);
-int jfs_remove (const char* file_name);
-int jfs_stat   (const char* name, struct stats* buf);
-int jfs_write  (const char* file_name, const void* buf, unsigned short count);
-int jfs_read   (const char* file_name, void* buf, unsigned short* ptr_count);
+int jfs_async_creat  (struct jfs_request* req, const char* path);
+int jfs_async_remove (struct jfs_request* req, const char* path);
+int jfs_async_stat   (struct jfs_request* req, const char* path, struct stats* buf);
+int jfs_async_write  (struct jfs_request* req, const char* path, const void* buf, unsigned short count);
+int jfs_async_read   (struct jfs_request* req, const char* path, void* buf, unsigned short count);
+int jfs_async_reap   (struct jfs_request* completed[], int max, int wait);
+int jfs_async_event_fd ();
 
 int jfs_unmount();
 
@@ -77,5 +280,10 @@ int jfs_unmount();
 #define E_MAX_DIR_ENTRIES -8 // the operation would cause the maximum number of entries in a directory to be exceeded
 #define E_MAX_FILE_SIZE -9   // the operation would cause the maximum file size to be exceeded
 #define E_DISK_FULL -10      // the disk is full (or the operation would require more capacity than remains on the disk)
+#define E_CHECKSUM -11       // a block read from disk failed checksum verification (it is corrupted)
+#define E_MAX_DIR_DEPTH -12  // the operation would exceed the maximum directory depth
+#define E_INVALID -13        // the operation makes no sense (e.g. moving a directory into itself)
+#define E_READ_ONLY -14      // the file system is mounted read-only (a snapshot)
+#define E_MAX_SNAPSHOTS -15  // the image already holds MAX_SNAPSHOTS snapshots
 
 #endif // _JUMBO_FILE_SYSTEM_H_
@@ -1,31 +1,395 @@
+#define _GNU_SOURCE // for O_DIRECT
 #include "raw_disk.h"
+#include "crc32c.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
-static const char* disk_filename = NULL;
-static int disk_fd = -1;
+// The blocks are striped across one or more member image files, stripe_unit
+// blocks at a time: stripe s (blocks s*stripe_unit ...) lives on member
+// s % num_members.  With a single member, block b is simply at offset
+// b * BLOCK_SIZE of the file.
+//
+// Member 0 also holds the metadata, after its own blocks: a table with one
+// CRC32C checksum per block, the auxiliary metadata area, and then the change
+// log.  A checksum of 0 means "none recorded yet", so images created before
+// checksums existed still mount and read normally.
+#define CHECKSUM_TABLE_OFFSET ((off_t) member_blocks * BLOCK_SIZE)
+#define AUX_OFFSET (CHECKSUM_TABLE_OFFSET + NUM_BLOCKS * sizeof(uint32_t))
+#define CHANGE_LOG_OFFSET (AUX_OFFSET + RAW_AUX_SIZE)
+#define METADATA_END (CHANGE_LOG_OFFSET + (off_t) sizeof(struct change_log))
 
+// Every member ends with a stripe label (right after its blocks, or after
+// member 0's metadata), written when the image is created, so that mounting
+// it with another stripe unit, other members or in another order fails
+// instead of scrambling the blocks.  Images from before the labels have none
+// and get one at their next mount.
+#define STRIPE_LABEL_MAGIC 0x5354524a // "JRTS"
+struct stripe_label {
+  uint32_t magic;
+  uint32_t count;     // number of members
+  uint32_t unit;      // stripe unit
+  uint32_t member;    // this file's position among the members
+  uint64_t image_id;  // the same on every member of an image
+};
 
-int raw_mount(const char* filename) {
-  // open file; creat if it doesn't exist already
-  disk_fd = open(filename, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
-  if (disk_fd < 0) {
+// The change log records the epoch in which each block (and the aux area)
+// was last written.  raw_checkpoint() ends the current epoch, so the blocks
+// written since a checkpoint are the ones stamped with a later epoch.  A
+// stamp is only written to disk the first time its block is written in an
+// epoch, so tracking costs one small write per changed block per epoch.
+// Epochs start at 1: 0 means "not written since tracking began".  An image
+// that incremental backups are applied to also records the checkpoint the
+// last one brought it up to, so that they can only be applied in order.
+struct change_log {
+  uint32_t epoch;     // the current epoch
+  uint32_t aux_epoch;
+  uint32_t block_epochs[NUM_BLOCKS];
+  uint32_t applied;   // checkpoint of the last backup applied, or 0
+};
+
+static int member_fds[MAX_STRIPE_MEMBERS];
+static int num_members = 0;
+static int stripe_unit = 1;
+static int member_blocks; // number of blocks stored in each member
+
+// Protects the checksum table, the block cache and the stats, so that
+// blocks can be read from several threads at once.  The lock is never held
+// while a block is transferred.
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t checksums[NUM_BLOCKS];
+static struct change_log changes;
+
+// Since blocks are transferred without disk_lock, a read can overlap a
+// write of the same block and see old, new or torn data.  Each block
+// counts the writes in flight, and a sequence number that every write
+// bumps when it starts and when it finishes.  A read only verifies and
+// caches what it got if no write was in flight when it started and the
+// sequence number is unchanged after it, and otherwise reads again.
+static int writes_in_flight[NUM_BLOCKS];
+static unsigned write_seq[NUM_BLOCKS];
+static struct raw_stats disk_stats;
+
+// set after anything is written, and cleared by raw_sync()
+static int dirty = 0;
+
+// With direct I/O (raw_set_direct_io), every transfer must be aligned to
+// DIRECT_IO_ALIGN in memory, file offset and length.  Transfers go through
+// an aligned bounce buffer, and writes that only cover part of an aligned
+// chunk read-modify-write the whole chunk, under direct_lock so that two
+// writes into the same chunk can't undo each other.
+#define DIRECT_IO_ALIGN 4096
+static int direct_io = 0;
+static pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Write-through block cache.  It is direct mapped (block b lives in slot
+// b % BLOCK_CACHE_SIZE), so consecutive blocks occupy consecutive slots.
+// Only blocks that passed checksum verification are ever cached.
+//
+// A slot can be pinned (raw_pin_block) to hand out a pointer to its data.
+// A pinned slot's data never changes: another block is simply not cached
+// while it is pinned, and writing the pinned block itself marks the slot
+// stale (so it is no longer served, and is dropped with its last pin).
+#define BLOCK_CACHE_SIZE 128
+static char cache_data[BLOCK_CACHE_SIZE][BLOCK_SIZE];
+static block_num_t cache_block[BLOCK_CACHE_SIZE];
+static char cache_valid[BLOCK_CACHE_SIZE];
+static char cache_stale[BLOCK_CACHE_SIZE];
+static int cache_pins[BLOCK_CACHE_SIZE];
+
+// maximum number of blocks raw_prefetch() and write_blocks() hand to the
+// members at once
+#define MAX_IO_BATCH 32
+
+// A segment is a run of blocks that are consecutive within one member file,
+// and so can be transferred with a single syscall
+struct segment {
+  int member;
+  off_t offset;   // byte offset within the member file
+  char* data;     // num_blocks * BLOCK_SIZE bytes
+  int num_blocks;
+  int result;     // 0 on success or -1 on failure
+};
+
+// With more than one member, each member has an I/O worker thread, so that
+// the segments of a batch that live on different members are transferred in
+// parallel.  Batches are run one at a time (batch_lock).
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t start;     // signalled when a batch is posted
+  pthread_cond_t done;      // signalled when the last worker finishes a batch
+  struct segment* segments;
+  int num_segments;
+  int is_write;
+  unsigned generation;      // incremented for every batch posted
+  int busy;                 // workers that have not finished the current batch
+  int shutdown;
+  pthread_t threads[MAX_STRIPE_MEMBERS];
+} io_workers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                 PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, 0, 0, {0} };
+
+
+// the aligned chunk(s) of a member file that cover [offset, offset + len)
+static void direct_span(size_t len, off_t offset, off_t* start, size_t* span) {
+  *start = offset & ~(off_t) (DIRECT_IO_ALIGN - 1);
+  *span = (offset + len - *start + DIRECT_IO_ALIGN - 1) & ~(size_t) (DIRECT_IO_ALIGN - 1);
+}
+
+// pread(), through a bounce buffer when direct I/O is on
+static ssize_t disk_pread(int fd, void* buf, size_t len, off_t offset) {
+  if (!direct_io) {
+    return pread(fd, buf, len, offset);
+  }
+  off_t start;
+  size_t span;
+  direct_span(len, offset, &start, &span);
+  void* bounce;
+  if (posix_memalign(&bounce, DIRECT_IO_ALIGN, span) != 0) {
     return -1;
   }
+  ssize_t ret = pread(fd, bounce, span, start);
+  if (ret >= (ssize_t) (offset - start + len)) {
+    memcpy(buf, (char*) bounce + (offset - start), len);
+    ret = len;
+  } else if (ret >= 0) {
+    ret = -1; // short read; the files are padded so this can't happen
+  }
+  free(bounce);
+  return ret;
+}
+
+// pwrite(), read-modify-writing whole aligned chunks when direct I/O is on
+static ssize_t disk_pwrite(int fd, const void* buf, size_t len, off_t offset) {
+  ssize_t ret;
+  if (!direct_io) {
+    ret = pwrite(fd, buf, len, offset);
+  } else {
+    off_t start;
+    size_t span;
+    direct_span(len, offset, &start, &span);
+    void* bounce;
+    if (posix_memalign(&bounce, DIRECT_IO_ALIGN, span) != 0) {
+      return -1;
+    }
+    pthread_mutex_lock(&direct_lock);
+    ret = 0;
+    if ((offset != start || len != span) && pread(fd, bounce, span, start) != (ssize_t) span) {
+      ret = -1;
+    }
+    if (ret == 0) {
+      memcpy((char*) bounce + (offset - start), buf, len);
+      ret = pwrite(fd, bounce, span, start) == (ssize_t) span ? (ssize_t) len : -1;
+    }
+    pthread_mutex_unlock(&direct_lock);
+    free(bounce);
+  }
+  if (ret > 0) {
+    __atomic_store_n(&dirty, 1, __ATOMIC_RELEASE);
+  }
+  return ret;
+}
+
+// checksum of a block as stored in the table (never 0, since 0 means unset)
+static uint32_t block_checksum(const void* buf) {
+  uint32_t crc = crc32c(0, buf, BLOCK_SIZE);
+  return crc ? crc : 1;
+}
+
+// checks a block just read from the disk against its stored checksum
+static int verify_block(block_num_t block_num, const void* buf) {
+  return checksums[block_num] == 0 || checksums[block_num] == block_checksum(buf);
+}
+
+// a write of a block is about to start (disk_lock held)
+static void begin_write(block_num_t block_num) {
+  writes_in_flight[block_num]++;
+  write_seq[block_num]++;
+}
+
+// a write of a block has finished, or failed (disk_lock held)
+static void end_write(block_num_t block_num) {
+  writes_in_flight[block_num]--;
+  write_seq[block_num]++;
+}
+
+// the sequence number a read of a block should see again after it, or 1
+// less if a write is in flight, which never matches (disk_lock held)
+static unsigned read_seq(block_num_t block_num) {
+  return write_seq[block_num] - (writes_in_flight[block_num] > 0);
+}
+
+static int cache_lookup(block_num_t block_num) {
+  int slot = block_num % BLOCK_CACHE_SIZE;
+  return cache_valid[slot] && !cache_stale[slot] && cache_block[slot] == block_num;
+}
+
+static void cache_insert(block_num_t block_num, const void* buf) {
+  int slot = block_num % BLOCK_CACHE_SIZE;
+  if (cache_pins[slot] > 0) {
+    if (cache_block[slot] == block_num) {
+      cache_stale[slot] = 1;
+    }
+    return;
+  }
+  memcpy(cache_data[slot], buf, BLOCK_SIZE);
+  cache_block[slot] = block_num;
+  cache_valid[slot] = 1;
+}
+
+// finds which member file holds a block, and where in that file it is
+static void locate_block(block_num_t block_num, int* member, off_t* offset) {
+  int stripe = block_num / stripe_unit;
+  *member = stripe % num_members;
+  *offset = ((off_t) (stripe / num_members) * stripe_unit + block_num % stripe_unit) * BLOCK_SIZE;
+}
+
+// records a new checksum for a block, in memory and in the table on disk
+static int store_checksum(block_num_t block_num, const void* buf) {
+  uint32_t crc = block_checksum(buf);
+  if (checksums[block_num] != crc) {
+    off_t offset = CHECKSUM_TABLE_OFFSET + block_num * sizeof(uint32_t);
+    if (disk_pwrite(member_fds[0], &crc, sizeof(crc), offset) != sizeof(crc)) {
+      return -1;
+    }
+    checksums[block_num] = crc;
+  }
+  return 0;
+}
+
+// records that a block was written in the current epoch (disk_lock held)
+static int stamp_block(block_num_t block_num) {
+  if (changes.block_epochs[block_num] != changes.epoch) {
+    off_t offset = CHANGE_LOG_OFFSET + offsetof(struct change_log, block_epochs) + block_num * sizeof(uint32_t);
+    if (disk_pwrite(member_fds[0], &changes.epoch, sizeof(uint32_t), offset) != sizeof(uint32_t)) {
+      return -1;
+    }
+    changes.block_epochs[block_num] = changes.epoch;
+  }
+  return 0;
+}
+
+// transfers the segments that live on one member, in order
+static void run_member_segments(int member, struct segment* segments, int count, int is_write) {
+  for (int i = 0; i < count; i++) {
+    struct segment* seg = &segments[i];
+    if (seg->member != member) {
+      continue;
+    }
+    ssize_t len = seg->num_blocks * BLOCK_SIZE;
+    ssize_t ret = is_write ? disk_pwrite(member_fds[member], seg->data, len, seg->offset)
+                           : disk_pread(member_fds[member], seg->data, len, seg->offset);
+    seg->result = (ret == len) ? 0 : -1;
+  }
+}
+
+static void* io_worker(void* arg) {
+  int member = (int) (long) arg;
+  unsigned seen = 0;
+  pthread_mutex_lock(&io_workers.lock);
+  for (;;) {
+    while (!io_workers.shutdown && io_workers.generation == seen) {
+      pthread_cond_wait(&io_workers.start, &io_workers.lock);
+    }
+    if (io_workers.shutdown) {
+      break;
+    }
+    seen = io_workers.generation;
+    pthread_mutex_unlock(&io_workers.lock);
+
+    run_member_segments(member, io_workers.segments, io_workers.num_segments, io_workers.is_write);
 
+    pthread_mutex_lock(&io_workers.lock);
+    if (--io_workers.busy == 0) {
+      pthread_cond_signal(&io_workers.done);
+    }
+  }
+  pthread_mutex_unlock(&io_workers.lock);
+  return NULL;
+}
+
+// transfers a batch of segments, in parallel across members when possible
+// returns 0 if every segment succeeded or -1 otherwise
+static int run_segments(struct segment* segments, int count, int is_write) {
+  int spans_members = 0;
+  for (int i = 1; i < count; i++) {
+    if (segments[i].member != segments[0].member) {
+      spans_members = 1;
+    }
+  }
+
+  if (!spans_members) {
+    // nothing to overlap; do it on this thread
+    if (count > 0) {
+      run_member_segments(segments[0].member, segments, count, is_write);
+    }
+  } else {
+    pthread_mutex_lock(&batch_lock);
+    pthread_mutex_lock(&io_workers.lock);
+    io_workers.segments = segments;
+    io_workers.num_segments = count;
+    io_workers.is_write = is_write;
+    io_workers.busy = num_members;
+    io_workers.generation++;
+    pthread_cond_broadcast(&io_workers.start);
+    while (io_workers.busy > 0) {
+      pthread_cond_wait(&io_workers.done, &io_workers.lock);
+    }
+    pthread_mutex_unlock(&io_workers.lock);
+    pthread_mutex_unlock(&batch_lock);
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (segments[i].result < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// splits a list of blocks into segments; block i of the list is transferred
+// to/from data + i * BLOCK_SIZE
+// returns the number of segments (at most count)
+static int build_segments(const block_num_t* blocks, int count, char* data, struct segment* segments) {
+  int num_segments = 0;
+  for (int i = 0; i < count; i++) {
+    int member;
+    off_t offset;
+    locate_block(blocks[i], &member, &offset);
+    struct segment* last = num_segments > 0 ? &segments[num_segments - 1] : NULL;
+    if (last != NULL && last->member == member &&
+        last->offset + last->num_blocks * BLOCK_SIZE == offset &&
+        last->data + last->num_blocks * BLOCK_SIZE == data + i * BLOCK_SIZE) {
+      last->num_blocks++;
+    } else {
+      struct segment* seg = &segments[num_segments++];
+      seg->member = member;
+      seg->offset = offset;
+      seg->data = data + i * BLOCK_SIZE;
+      seg->num_blocks = 1;
+      seg->result = 0;
+    }
+  }
+  return num_segments;
+}
+
+// makes sure a file is at least size bytes long, filling any extension with 0's
+static int extend_file(int fd, off_t size) {
   // check the file size
-  off_t file_size = lseek(disk_fd, 0, SEEK_END);
+  off_t file_size = lseek(fd, 0, SEEK_END);
   if (file_size < 0) {
-    close(disk_fd);
-    disk_fd = -1;
     return -1;
 
-  } else if (file_size < NUM_BLOCKS * BLOCK_SIZE) {
+  } else if (file_size < size) {
     // if the file size is less than it should be, we need to extend it
-    long to_write = NUM_BLOCKS * BLOCK_SIZE - file_size;
+    long to_write = size - file_size;
     char* buffer = (char*) malloc(to_write * sizeof(char));
     // make sure the new allocation writes 0's to the disk
     for (int i = 0; i < to_write; i++) {
@@ -33,49 +397,520 @@ int raw_mount(const char* filename) {
     }
 
     // commit the file extension to disk
-    if (write(disk_fd, buffer, to_write) < to_write) {
-      close(disk_fd);
-      disk_fd = -1;
+    if (write(fd, buffer, to_write) < to_write) {
       free(buffer);
       return -1;
     }
     free(buffer);
   }
+  return 0;
+}
+
+// where a member's stripe label is when each member holds blocks blocks
+static off_t label_offset(int member, int blocks) {
+  off_t offset = (off_t) blocks * BLOCK_SIZE;
+  if (member == 0) {
+    offset += NUM_BLOCKS * sizeof(uint32_t) + RAW_AUX_SIZE + sizeof(struct change_log);
+  }
+  return offset;
+}
+
+// reads the stripe label at offset of a member file
+// returns 1 if there is one, or 0 if not
+static int read_label(int fd, off_t offset, struct stripe_label* label) {
+  return pread(fd, label, sizeof(*label), offset) == sizeof(*label) &&
+         label->magic == STRIPE_LABEL_MAGIC && label->count >= 1 &&
+         label->count <= MAX_STRIPE_MEMBERS && label->member < label->count;
+}
 
-  disk_filename = filename;
+// returns 1 if a member file has a stripe label anywhere some striping
+// (stripe unit, number of members and position) would put it, or 0 if not
+static int has_any_label(int fd) {
+  struct stripe_label label;
+  for (int count = 1; count <= MAX_STRIPE_MEMBERS; count++) {
+    for (int unit = 1; unit <= NUM_BLOCKS; unit *= 2) {
+      int blocks = ((NUM_BLOCKS / unit + count - 1) / count) * unit;
+      if (read_label(fd, label_offset(0, blocks), &label) ||
+          (count > 1 && read_label(fd, label_offset(1, blocks), &label))) {
+        return 1;
+      }
+    }
+  }
   return 0;
 }
 
+// checks the members' stripe labels against the mount's striping, or labels
+// the members if none of them has a label yet
+// returns 0 on success or -1 if they don't match (or can't be written)
+static int check_labels() {
+  struct stripe_label labels[MAX_STRIPE_MEMBERS];
+  int labelled[MAX_STRIPE_MEMBERS];
+  int num_labelled = 0;
+  for (int m = 0; m < num_members; m++) {
+    labelled[m] = read_label(member_fds[m], label_offset(m, member_blocks), &labels[m]);
+    if (labelled[m]) {
+      num_labelled++;
+    } else if (has_any_label(member_fds[m])) {
+      return -1; // labelled for another striping or position
+    }
+  }
 
-int read_block(block_num_t block_num, void* buf) {
-  // go to the block
-  if (lseek(disk_fd, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
+  if (num_labelled == 0) {
+    // a new image (or one from before the labels)
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct stripe_label label;
+    memset(&label, 0, sizeof(label));
+    label.magic = STRIPE_LABEL_MAGIC;
+    label.count = num_members;
+    label.unit = stripe_unit;
+    label.image_id = ((uint64_t) ts.tv_sec << 32) ^ ts.tv_nsec ^ ((uint64_t) getpid() << 16);
+    for (int m = 0; m < num_members; m++) {
+      label.member = m;
+      off_t offset = label_offset(m, member_blocks);
+      if (pwrite(member_fds[m], &label, sizeof(label), offset) != sizeof(label)) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  for (int m = 0; m < num_members; m++) {
+    if (!labelled[m] || labels[m].count != (uint32_t) num_members ||
+        labels[m].unit != (uint32_t) stripe_unit || labels[m].member != (uint32_t) m ||
+        labels[m].image_id != labels[0].image_id) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// stops the first count I/O workers
+static void stop_io_workers(int count) {
+  pthread_mutex_lock(&io_workers.lock);
+  io_workers.shutdown = 1;
+  pthread_cond_broadcast(&io_workers.start);
+  pthread_mutex_unlock(&io_workers.lock);
+  for (int m = 0; m < count; m++) {
+    pthread_join(io_workers.threads[m], NULL);
+  }
+}
+
+static void close_members(int count) {
+  for (int m = 0; m < count; m++) {
+    close(member_fds[m]);
+    member_fds[m] = -1;
+  }
+  num_members = 0;
+}
+
+
+int raw_mount(const char* filename) {
+  return raw_mount_striped(&filename, 1, 1);
+}
+
+
+int raw_mount_striped(const char* const filenames[], int count, int unit) {
+  if (count < 1 || count > MAX_STRIPE_MEMBERS ||
+      unit < 1 || unit > NUM_BLOCKS || (unit & (unit - 1)) != 0) {
     return -1;
   }
-  // read the block
-  int ret = read(disk_fd, buf, BLOCK_SIZE);
-  if (ret != BLOCK_SIZE) {
+  num_members = count;
+  stripe_unit = unit;
+  member_blocks = ((NUM_BLOCKS / unit + count - 1) / count) * unit;
+
+  for (int m = 0; m < count; m++) {
+    // open file; creat if it doesn't exist already
+    member_fds[m] = open(filenames[m], O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
+    if (member_fds[m] < 0) {
+      close_members(m);
+      return -1;
+    }
+    off_t size = (off_t) member_blocks * BLOCK_SIZE;
+    if (m == 0) {
+      size = METADATA_END;
+    }
+    if (extend_file(member_fds[m], size) < 0) {
+      close_members(m + 1);
+      return -1;
+    }
+  }
+
+  if (check_labels() < 0) {
+    close_members(count);
+    return -1;
+  }
+
+  // load the checksum table and the change log
+  if (pread(member_fds[0], checksums, sizeof(checksums), CHECKSUM_TABLE_OFFSET) != sizeof(checksums) ||
+      pread(member_fds[0], &changes, sizeof(changes), CHANGE_LOG_OFFSET) != sizeof(changes)) {
+    close_members(count);
     return -1;
   }
+  if (changes.epoch == 0) {
+    changes.epoch = 1;
+  }
+
+  // start the I/O workers
+  if (count > 1) {
+    io_workers.shutdown = 0;
+    io_workers.generation = 0;
+    for (int m = 0; m < count; m++) {
+      if (pthread_create(&io_workers.threads[m], NULL, io_worker, (void*) (long) m) != 0) {
+        stop_io_workers(m);
+        close_members(count);
+        return -1;
+      }
+    }
+  }
+
+  memset(&disk_stats, 0, sizeof(disk_stats));
+  memset(cache_valid, 0, sizeof(cache_valid));
+  memset(cache_stale, 0, sizeof(cache_stale));
+  memset(cache_pins, 0, sizeof(cache_pins));
+  direct_io = 0;
+  dirty = 0;
+  return 0;
+}
+
+
+int raw_set_direct_io(int enable) {
+  for (int m = 0; m < num_members; m++) {
+    // pad the file so every aligned chunk that holds data is complete
+    off_t size = lseek(member_fds[m], 0, SEEK_END);
+    if (enable && (size < 0 || extend_file(member_fds[m], (size + DIRECT_IO_ALIGN - 1) & ~(off_t) (DIRECT_IO_ALIGN - 1)) < 0)) {
+      return -1;
+    }
+    int flags = fcntl(member_fds[m], F_GETFL);
+    if (flags < 0) {
+      return -1;
+    }
+    flags = enable ? flags | O_DIRECT : flags & ~O_DIRECT;
+    if (fcntl(member_fds[m], F_SETFL, flags) < 0) {
+      // the host file system doesn't support it; put back the members
+      // that were already switched
+      for (int i = 0; i < m; i++) {
+        fcntl(member_fds[i], F_SETFL, fcntl(member_fds[i], F_GETFL) ^ O_DIRECT);
+      }
+      return -1;
+    }
+  }
+  direct_io = enable;
   return 0;
 }
 
 
+int raw_sync() {
+  // nothing was written since the last sync
+  if (!__atomic_exchange_n(&dirty, 0, __ATOMIC_ACQ_REL)) {
+    return 0;
+  }
+  int ret = 0;
+  for (int m = 0; m < num_members; m++) {
+    if (fdatasync(member_fds[m]) < 0) {
+      ret = -1;
+    }
+  }
+  pthread_mutex_lock(&disk_lock);
+  disk_stats.syncs++;
+  pthread_mutex_unlock(&disk_lock);
+  if (ret < 0) {
+    // try again next time
+    __atomic_store_n(&dirty, 1, __ATOMIC_RELEASE);
+  }
+  return ret;
+}
+
+
+int read_block(block_num_t block_num, void* buf) {
+  // serve the block from the cache if it is there
+  pthread_mutex_lock(&disk_lock);
+  disk_stats.reads++;
+  int member;
+  off_t offset;
+  locate_block(block_num, &member, &offset);
+  for (;;) {
+    if (cache_lookup(block_num)) {
+      memcpy(buf, cache_data[block_num % BLOCK_CACHE_SIZE], BLOCK_SIZE);
+      disk_stats.cache_hits++;
+      pthread_mutex_unlock(&disk_lock);
+      return 0;
+    }
+    unsigned seq = read_seq(block_num);
+    pthread_mutex_unlock(&disk_lock);
+
+    // read the block from the member that holds it
+    if (disk_pread(member_fds[member], buf, BLOCK_SIZE, offset) != BLOCK_SIZE) {
+      return -1;
+    }
+    // verify the block against its stored checksum, unless a write of it
+    // got in the way, in which case read it again
+    pthread_mutex_lock(&disk_lock);
+    if (write_seq[block_num] == seq) {
+      break;
+    }
+  }
+  int ret = 0;
+  if (!verify_block(block_num, buf)) {
+    disk_stats.checksum_errors++;
+    ret = RAW_E_CHECKSUM;
+  } else {
+    cache_insert(block_num, buf);
+  }
+  pthread_mutex_unlock(&disk_lock);
+  return ret;
+}
+
+
 int write_block(block_num_t block_num, void* buf) {
-  // go to the block
-  if (lseek(disk_fd, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
+  // write the block to the member that holds it
+  int member;
+  off_t offset;
+  locate_block(block_num, &member, &offset);
+  pthread_mutex_lock(&disk_lock);
+  begin_write(block_num);
+  pthread_mutex_unlock(&disk_lock);
+  int written = disk_pwrite(member_fds[member], buf, BLOCK_SIZE, offset) == BLOCK_SIZE;
+  // update the stored checksum (only if the data actually changed it)
+  pthread_mutex_lock(&disk_lock);
+  int ret = -1;
+  if (written) {
+    disk_stats.writes++;
+    ret = store_checksum(block_num, buf);
+    if (stamp_block(block_num) < 0) {
+      ret = -1;
+    }
+    cache_insert(block_num, buf);
+  }
+  end_write(block_num);
+  pthread_mutex_unlock(&disk_lock);
+  return ret;
+}
+
+
+int write_blocks(const block_num_t* blocks, int count, const void* buf) {
+  struct segment segments[MAX_IO_BATCH];
+  const char* data = buf;
+  for (int done = 0; done < count; done += MAX_IO_BATCH) {
+    int n = count - done < MAX_IO_BATCH ? count - done : MAX_IO_BATCH;
+    pthread_mutex_lock(&disk_lock);
+    for (int i = done; i < done + n; i++) {
+      begin_write(blocks[i]);
+    }
+    pthread_mutex_unlock(&disk_lock);
+    // the data is only read from, even though segments are shared with reads
+    int num_segments = build_segments(blocks + done, n, (char*) data + done * BLOCK_SIZE, segments);
+    int ret = run_segments(segments, num_segments, 1);
+    pthread_mutex_lock(&disk_lock);
+    for (int i = done; i < done + n; i++) {
+      if (ret == 0) {
+        disk_stats.writes++;
+        if (store_checksum(blocks[i], data + i * BLOCK_SIZE) < 0 || stamp_block(blocks[i]) < 0) {
+          ret = -1;
+        }
+        cache_insert(blocks[i], data + i * BLOCK_SIZE);
+      }
+      end_write(blocks[i]);
+    }
+    pthread_mutex_unlock(&disk_lock);
+    if (ret < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+int raw_prefetch(const block_num_t* blocks, int count) {
+  block_num_t to_read[MAX_IO_BATCH];
+  unsigned seqs[MAX_IO_BATCH];
+  char data[MAX_IO_BATCH * BLOCK_SIZE];
+  struct segment segments[MAX_IO_BATCH];
+  int i = 0;
+  while (i < count) {
+    // gather the next batch of blocks that are not cached yet
+    int n = 0;
+    pthread_mutex_lock(&disk_lock);
+    for (; i < count && n < MAX_IO_BATCH; i++) {
+      if (!cache_lookup(blocks[i])) {
+        seqs[n] = read_seq(blocks[i]);
+        to_read[n++] = blocks[i];
+      }
+    }
+    pthread_mutex_unlock(&disk_lock);
+
+    // read them all (runs that are consecutive on a member with one read
+    // each), and cache every block that no write got in the way of and
+    // that verifies
+    int num_segments = build_segments(to_read, n, data, segments);
+    if (run_segments(segments, num_segments, 0) < 0) {
+      return -1;
+    }
+    pthread_mutex_lock(&disk_lock);
+    for (int j = 0; j < n; j++) {
+      if (write_seq[to_read[j]] == seqs[j] && verify_block(to_read[j], data + j * BLOCK_SIZE)) {
+        cache_insert(to_read[j], data + j * BLOCK_SIZE);
+        disk_stats.prefetched++;
+      }
+    }
+    pthread_mutex_unlock(&disk_lock);
+  }
+  return 0;
+}
+
+
+int raw_pin_block(block_num_t block_num, const void** data) {
+  int slot = block_num % BLOCK_CACHE_SIZE;
+  // a write or another pin may get in between reading the block and caching
+  // it, so try a few times
+  for (int attempt = 0; attempt < 3; attempt++) {
+    pthread_mutex_lock(&disk_lock);
+    if (cache_lookup(block_num)) {
+      cache_pins[slot]++;
+      *data = cache_data[slot];
+      disk_stats.reads++;
+      disk_stats.cache_hits++;
+      pthread_mutex_unlock(&disk_lock);
+      return 0;
+    }
+    if (cache_pins[slot] > 0) {
+      pthread_mutex_unlock(&disk_lock);
+      return RAW_E_BUSY;
+    }
+    pthread_mutex_unlock(&disk_lock);
+
+    // read_block() caches the block, unless something else gets the slot
+    char buf[BLOCK_SIZE];
+    int ret = read_block(block_num, buf);
+    if (ret < 0) {
+      return ret;
+    }
+    pthread_mutex_lock(&disk_lock);
+    if (cache_lookup(block_num)) {
+      cache_pins[slot]++;
+      *data = cache_data[slot];
+      pthread_mutex_unlock(&disk_lock);
+      return 0;
+    }
+    pthread_mutex_unlock(&disk_lock);
+  }
+  return RAW_E_BUSY;
+}
+
+
+void raw_unpin_block(block_num_t block_num) {
+  int slot = block_num % BLOCK_CACHE_SIZE;
+  pthread_mutex_lock(&disk_lock);
+  if (cache_pins[slot] > 0 && --cache_pins[slot] == 0 && cache_stale[slot]) {
+    cache_valid[slot] = 0;
+    cache_stale[slot] = 0;
+  }
+  pthread_mutex_unlock(&disk_lock);
+}
+
+
+int raw_read_aux(uint32_t offset, void* buf, uint32_t len) {
+  if (offset + len > RAW_AUX_SIZE) {
     return -1;
   }
-  // write the block
-  int ret = write(disk_fd, buf, BLOCK_SIZE);
-  if (ret != BLOCK_SIZE) {
+  if (disk_pread(member_fds[0], buf, len, AUX_OFFSET + offset) != (ssize_t) len) {
     return -1;
   }
   return 0;
 }
 
 
+int raw_write_aux(uint32_t offset, const void* buf, uint32_t len) {
+  if (offset + len > RAW_AUX_SIZE) {
+    return -1;
+  }
+  if (disk_pwrite(member_fds[0], buf, len, AUX_OFFSET + offset) != (ssize_t) len) {
+    return -1;
+  }
+  int ret = 0;
+  pthread_mutex_lock(&disk_lock);
+  if (changes.aux_epoch != changes.epoch) {
+    off_t stamp_offset = CHANGE_LOG_OFFSET + offsetof(struct change_log, aux_epoch);
+    if (disk_pwrite(member_fds[0], &changes.epoch, sizeof(uint32_t), stamp_offset) == sizeof(uint32_t)) {
+      changes.aux_epoch = changes.epoch;
+    } else {
+      ret = -1;
+    }
+  }
+  pthread_mutex_unlock(&disk_lock);
+  return ret;
+}
+
+
+uint32_t raw_checkpoint() {
+  pthread_mutex_lock(&disk_lock);
+  uint32_t checkpoint = changes.epoch;
+  uint32_t next = checkpoint + 1;
+  if (disk_pwrite(member_fds[0], &next, sizeof(next), CHANGE_LOG_OFFSET) == sizeof(next)) {
+    changes.epoch = next;
+  } else {
+    checkpoint = 0;
+  }
+  pthread_mutex_unlock(&disk_lock);
+  return checkpoint;
+}
+
+
+int raw_changed_blocks(uint32_t since, block_num_t* blocks, int* aux_changed) {
+  int count = 0;
+  pthread_mutex_lock(&disk_lock);
+  for (int b = 0; b < NUM_BLOCKS; b++) {
+    if (since == 0 || changes.block_epochs[b] > since) {
+      blocks[count++] = b;
+    }
+  }
+  *aux_changed = since == 0 || changes.aux_epoch > since;
+  pthread_mutex_unlock(&disk_lock);
+  return count;
+}
+
+
+uint32_t raw_applied_checkpoint() {
+  pthread_mutex_lock(&disk_lock);
+  uint32_t applied = changes.applied;
+  pthread_mutex_unlock(&disk_lock);
+  return applied;
+}
+
+
+int raw_set_applied_checkpoint(uint32_t checkpoint) {
+  int ret = 0;
+  pthread_mutex_lock(&disk_lock);
+  off_t offset = CHANGE_LOG_OFFSET + offsetof(struct change_log, applied);
+  if (disk_pwrite(member_fds[0], &checkpoint, sizeof(checkpoint), offset) == sizeof(checkpoint)) {
+    changes.applied = checkpoint;
+  } else {
+    ret = -1;
+  }
+  pthread_mutex_unlock(&disk_lock);
+  return ret;
+}
+
+
+void raw_get_stats(struct raw_stats* buf) {
+  pthread_mutex_lock(&disk_lock);
+  *buf = disk_stats;
+  pthread_mutex_unlock(&disk_lock);
+}
+
+
 int raw_unmount() {
-  disk_filename = NULL;
-  return close(disk_fd);
+  // stop the I/O workers
+  if (num_members > 1) {
+    stop_io_workers(num_members);
+  }
+
+  int ret = 0;
+  for (int m = 0; m < num_members; m++) {
+    if (close(member_fds[m]) < 0) {
+      ret = -1;
+    }
+  }
+  num_members = 0;
+  return ret;
 }
@@ -10,15 +10,58 @@
 // and is a 16-bit unsigned integer
 typedef uint16_t block_num_t;
 
+// maximum number of image files the blocks can be striped across
+#define MAX_STRIPE_MEMBERS 8
+
+// size (in bytes) of the auxiliary metadata area stored in the DISK file
+// alongside the blocks; upper layers use it for tables that do not fit in
+// the block space (see raw_read_aux/raw_write_aux)
+#define RAW_AUX_SIZE 4096
+
+// read_block returns this (instead of -1) when the block's data does not
+// match the checksum recorded the last time it was written
+#define RAW_E_CHECKSUM -2
+
+// raw_pin_block returns this when the block's cache slot is pinned by
+// another block (or by an older version of the same block)
+#define RAW_E_BUSY -3
+
+// Counters returned by raw_get_stats()
+struct raw_stats {
+  uint64_t reads;           // number of read_block() calls
+  uint64_t writes;          // number of write_block() calls
+  uint64_t checksum_errors; // number of reads that failed checksum verification
+  uint64_t cache_hits;      // number of reads served from the block cache
+  uint64_t prefetched;      // number of blocks loaded into the cache by raw_prefetch()
+  uint64_t syncs;           // number of raw_sync() calls that flushed anything
+};
+
 
 int raw_mount(const char* filename);
 
+/* raw_mount_striped
+ *   like raw_mount, but stripes the blocks across several image files (RAID-0)
+ *   so that batched transfers (raw_prefetch, write_blocks) are spread over all
+ *   of them in parallel; raw_mount(filename) is raw_mount_striped with a
+ *   single file
+ * filenames - the member image files, in order (each is created if needed)
+ * count - number of member files (1 to MAX_STRIPE_MEMBERS)
+ * unit - stripe unit: the number of consecutive blocks stored on one member
+ *   before moving on to the next (a power of 2, at most NUM_BLOCKS)
+ * returns 0 on success or -1 on failure, including when the files were
+ *   created with another stripe unit, other members or in another order (an
+ *   image must always be mounted with the same members, in the same order,
+ *   and with the same stripe unit; each member records them)
+ */
+int raw_mount_striped(const char* const filenames[], int count, int unit);
+
 /* read_block
  *   reads a block from the disk
  * block_num - number of the block to read
  * buf - data read from disk will be copied into this buffer
  * (precondition: buf is BLOCK_SIZE bytes long)
- * returns 0 on success or -1 on failure
+ * returns 0 on success, RAW_E_CHECKSUM if the data read does not match the
+ *   block's stored CRC32C checksum, or -1 on any other failure
  */
 int read_block(block_num_t block_num, void* buf);
 
@@ -28,9 +71,128 @@ int read_block(block_num_t block_num, void* buf);
  * buf - buffer containing the data to write to disk
  * (precondition: buf is BLOCK_SIZE bytes long)
  * return 0 on success or -1 on failure
+ * (the block's CRC32C checksum is updated along with its data)
  */
 int write_block(block_num_t block_num, void* buf);
 
+/* write_blocks
+ *   writes several blocks to the disk, exactly like calling write_block() on
+ *   each of them, but transferring blocks that are consecutive on disk with a
+ *   single write and blocks on different stripe members in parallel
+ * blocks - numbers of the blocks to write
+ * count - number of entries in blocks
+ * buf - buffer containing the data to write; block blocks[i] is written from
+ *   buf + i * BLOCK_SIZE (precondition: buf is count * BLOCK_SIZE bytes long)
+ * returns 0 on success or -1 on failure
+ */
+int write_blocks(const block_num_t* blocks, int count, const void* buf);
+
+/* raw_prefetch
+ *   loads the given blocks into the block cache ahead of the read_block()
+ *   calls that will need them; runs of consecutive block numbers are fetched
+ *   from the disk with a single read
+ * blocks - numbers of the blocks to prefetch, in the order they will be read
+ * count - number of entries in blocks
+ * returns 0 on success or -1 on failure (a failed prefetch is harmless; the
+ *   blocks will simply be read by read_block() instead)
+ */
+int raw_prefetch(const block_num_t* blocks, int count);
+
+/* raw_pin_block
+ *   makes sure a block is in the block cache and pins it there, so that its
+ *   data can be used in place, without copying it; the data stays valid and
+ *   unchanged until raw_unpin_block() (writing the block meanwhile does not
+ *   change the pinned copy)
+ * block_num - number of the block to pin
+ * data - set to the block's BLOCK_SIZE bytes of data in the cache; consecutive
+ *   blocks are cached next to each other (unless the cache wraps around)
+ * returns 0 on success, RAW_E_CHECKSUM if the block is corrupted, RAW_E_BUSY
+ *   if its cache slot is pinned for another block (read it with read_block()
+ *   instead), or -1 on any other failure
+ */
+int raw_pin_block(block_num_t block_num, const void** data);
+
+/* raw_unpin_block
+ *   drops one pin taken by raw_pin_block()
+ */
+void raw_unpin_block(block_num_t block_num);
+
+/* raw_read_aux
+ *   reads bytes from the auxiliary metadata area
+ * offset - byte offset within the area
+ * buf - buffer the data will be copied into (at least len bytes long)
+ * len - number of bytes to read (offset + len must be <= RAW_AUX_SIZE)
+ * returns 0 on success or -1 on failure
+ */
+int raw_read_aux(uint32_t offset, void* buf, uint32_t len);
+
+/* raw_write_aux
+ *   writes bytes to the auxiliary metadata area
+ * offset - byte offset within the area
+ * buf - buffer containing the data to write
+ * len - number of bytes to write (offset + len must be <= RAW_AUX_SIZE)
+ * returns 0 on success or -1 on failure
+ */
+int raw_write_aux(uint32_t offset, const void* buf, uint32_t len);
+
+/* raw_checkpoint
+ *   ends the current change-tracking epoch: every block (and aux area byte)
+ *   written from now on is reported by raw_changed_blocks() as changed since
+ *   the checkpoint returned here; checkpoints are kept in the image, so they
+ *   stay valid across mounts
+ * returns the checkpoint (never 0), or 0 on failure
+ */
+uint32_t raw_checkpoint();
+
+/* raw_changed_blocks
+ *   lists the blocks written since a checkpoint, in block number order
+ * since - a checkpoint returned by raw_checkpoint(), or 0 to list every block
+ * blocks - array (allocated by the caller, NUM_BLOCKS entries long) where the
+ *   block numbers will be written
+ * aux_changed - set to 1 if the aux area was written since the checkpoint,
+ *   or to 0 otherwise
+ * returns the number of blocks written to blocks
+ */
+int raw_changed_blocks(uint32_t since, block_num_t* blocks, int* aux_changed);
+
+/* raw_applied_checkpoint
+ *   returns the checkpoint recorded by raw_set_applied_checkpoint(), or 0 if
+ *   none was
+ */
+uint32_t raw_applied_checkpoint();
+
+/* raw_set_applied_checkpoint
+ *   records in the image that it holds another image's contents as of one of
+ *   that image's checkpoints (after an incremental backup is applied to it)
+ * checkpoint - the other image's checkpoint
+ * returns 0 on success or -1 on failure
+ */
+int raw_set_applied_checkpoint(uint32_t checkpoint);
+
+/* raw_set_direct_io
+ *   turns direct I/O (O_DIRECT: transfers bypass the host's page cache) on or
+ *   off for the mounted image; since O_DIRECT transfers must be aligned to
+ *   the device's blocks, block transfers go through aligned bounce buffers,
+ *   and writing a block reads and rewrites the aligned chunk around it (the
+ *   image files are padded to a multiple of that chunk size)
+ * enable - 1 to turn direct I/O on, 0 to turn it off
+ * returns 0 on success or -1 on failure (for example when the host file
+ *   system does not support O_DIRECT)
+ */
+int raw_set_direct_io(int enable);
+
+/* raw_sync
+ *   flushes everything written so far to stable storage (fdatasync on every
+ *   image file); returns at once if nothing was written since the last sync
+ * returns 0 on success or -1 on failure
+ */
+int raw_sync();
+
+/* raw_get_stats
+ *   copies the disk I/O counters accumulated since raw_mount() into buf
+ */
+void raw_get_stats(struct raw_stats* buf);
+
 int raw_unmount();
 
 #endif // _RAW_DISK_H_
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <inttypes.h>
+#include "jumbo_file_system.h"
+#include "jfs_trace.h"
+
+#define DISK_FILENAME "DISK"
+
+static const char* op_names[JFS_NUM_OPS] = {
+  [JFS_OP_CREAT] = "creat",
+  [JFS_OP_REMOVE] = "remove",
+  [JFS_OP_STAT] = "stat",
+  [JFS_OP_WRITE] = "write",
+  [JFS_OP_READ] = "read",
+  [JFS_OP_MKDIR] = "mkdir",
+  [JFS_OP_CHDIR] = "chdir",
+  [JFS_OP_OPENDIR] = "opendir",
+  [JFS_OP_RMDIR] = "rmdir",
+  [JFS_OP_DU] = "du",
+  [JFS_OP_REMOVE_TREE] = "rm -r",
+  [JFS_OP_FIND] = "find",
+  [JFS_OP_DEFRAG] = "defrag",
+  [JFS_OP_RENAME] = "rename",
+  [JFS_OP_READ_VIEW] = "readview",
+  [JFS_OP_SYNC] = "sync",
+  [JFS_OP_CHECKPOINT] = "checkpt",
+  [JFS_OP_SNAPSHOT_CREATE] = "snapnew",
+  [JFS_OP_SNAPSHOT_DELETE] = "snaprm",
+  [JFS_OP_SNAPSHOT_LIST] = "snapls",
+};
+
+// results for one op type
+struct op_stats {
+  uint64_t count;
+  uint64_t errors;       // calls that returned an error during the replay
+  uint64_t total_ns;     // time spent in the calls during the replay
+  uint64_t max_ns;
+  uint64_t recorded_us;  // time the calls took when the trace was recorded
+};
+
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static int ignore_entry(const char* path, const struct stats* buf, void* arg) {
+  (void) path;
+  (void) buf;
+  (void) arg;
+  return 0;
+}
+
+
+/* replay_call
+ *   runs one recorded jfs_* call; the data written is filler, since traces
+ *   only record sizes
+ * returns what the jfs_* function returned
+ */
+static int replay_call(const struct trace_record* record, const char* name) {
+  static char data[USHRT_MAX + 1];
+  struct stats stats;
+  struct usage usage;
+  struct defrag_stats defrag_stats;
+  struct jfs_dir dir;
+  struct jfs_dirent entry;
+  unsigned short count = record->count;
+
+  switch (record->op) {
+  case JFS_OP_CREAT:
+    return jfs_creat(name);
+  case JFS_OP_REMOVE:
+    return jfs_remove(name);
+  case JFS_OP_STAT:
+    return jfs_stat(name, &stats);
+  case JFS_OP_WRITE:
+    memset(data, 'x', count);
+    return jfs_write(name, data, count);
+  case JFS_OP_READ:
+    return jfs_read(name, data, &count);
+  case JFS_OP_MKDIR:
+    return jfs_mkdir(name);
+  case JFS_OP_CHDIR:
+    return jfs_chdir(name);
+  case JFS_OP_OPENDIR: {
+    int ret = jfs_opendir(name, &dir);
+    while (ret == E_SUCCESS && jfs_readdir(&dir, &entry)) {
+    }
+    return ret;
+  }
+  case JFS_OP_RMDIR:
+    return jfs_rmdir(name);
+  case JFS_OP_DU:
+    return jfs_du(name, &usage);
+  case JFS_OP_REMOVE_TREE:
+    return jfs_remove_tree(name);
+  case JFS_OP_FIND:
+    return jfs_find(name, ignore_entry, NULL);
+  case JFS_OP_DEFRAG:
+    return jfs_defrag(&defrag_stats);
+  case JFS_OP_READ_VIEW: {
+    struct jfs_view view;
+    int ret = jfs_read_view(name, count, &view);
+    if (ret == E_SUCCESS) {
+      jfs_release_view(&view);
+    }
+    return ret;
+  }
+  case JFS_OP_RENAME:
+    // the destination follows the source, after a NUL
+    return jfs_rename(name, name + strlen(name) + 1);
+  case JFS_OP_SYNC:
+    return jfs_sync();
+  case JFS_OP_CHECKPOINT:
+    return jfs_checkpoint() == 0 ? E_UNKNOWN : E_SUCCESS;
+  case JFS_OP_SNAPSHOT_CREATE:
+    return jfs_snapshot_create(name);
+  case JFS_OP_SNAPSHOT_DELETE:
+    return jfs_snapshot_delete(name);
+  case JFS_OP_SNAPSHOT_LIST: {
+    struct jfs_snapshot snapshots[MAX_SNAPSHOTS];
+    return jfs_snapshot_list(snapshots, MAX_SNAPSHOTS) < 0 ? E_UNKNOWN : E_SUCCESS;
+  }
+  default:
+    return E_UNKNOWN;
+  }
+}
+
+
+/* print_report
+ *   prints throughput and latency per op type
+ */
+static void print_report(const struct op_stats stats[JFS_NUM_OPS], uint64_t elapsed_ns) {
+  uint64_t total = 0;
+  printf("%-8s %8s %7s %10s %10s %10s %12s\n",
+         "op", "count", "errors", "ops/s", "avg us", "max us", "recorded us");
+  for (int op = 1; op < JFS_NUM_OPS; op++) {
+    const struct op_stats* s = &stats[op];
+    if (s->count == 0) {
+      continue;
+    }
+    total += s->count;
+    printf("%-8s %8" PRIu64 " %7" PRIu64 " %10.0f %10.2f %10.2f %12.2f\n", op_names[op],
+           s->count, s->errors, s->count * 1e9 / (s->total_ns ? s->total_ns : 1),
+           s->total_ns / 1e3 / s->count, s->max_ns / 1e3,
+           (double) s->recorded_us / s->count);
+  }
+  printf("%" PRIu64 " ops in %.3f s (%.0f ops/s)\n", total, elapsed_ns / 1e9,
+         total * 1e9 / (elapsed_ns ? elapsed_ns : 1));
+}
+
+
+int main(int argc, char* argv[]) {
+  const char* disk = DISK_FILENAME;
+  int original_timing = 0;
+  struct mount_options options;
+  memset(&options, 0, sizeof(options));
+  int opt;
+  while ((opt = getopt(argc, argv, "Dei:Mos:")) != -1) {
+    switch (opt) {
+    case 'i':
+      disk = optarg;
+      break;
+    case 'D':
+      options.flags |= JFS_MOUNT_DIRECT_IO;
+      break;
+    case 'e':
+      options.flags |= JFS_MOUNT_EXTENT_ALLOC;
+      break;
+    case 'M':
+      options.flags |= JFS_MOUNT_METADATA_CACHE;
+      break;
+    case 'o':
+      original_timing = 1;
+      break;
+    case 's':
+      if (jfs_parse_durability(optarg, &options) < 0) {
+        fprintf(stderr, "unknown durability policy: %s\n", optarg);
+        return 1;
+      }
+      break;
+    default:
+      optind = argc; // print the usage below
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-o] [-i image_file] [-D] [-e] [-M] [-s durability] trace_file\n"
+                    "  -o  wait between calls as long as the recorded program did\n"
+                    "      (default: replay at full speed)\n"
+                    "  -i  replay against this image instead of " DISK_FILENAME "\n"
+                    "  -D  use direct I/O (O_DIRECT)\n"
+                    "  -e  allocate from a tree of free extents\n"
+                    "  -M  keep all directories and inodes in memory\n"
+                    "  -s  durability policy: none (the default), periodic[:interval_ms] or sync\n", argv[0]);
+    return 1;
+  }
+
+  FILE* trace = fopen(argv[optind], "rb");
+  if (trace == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+  struct trace_header header;
+  if (fread(&header, sizeof(header), 1, trace) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_VERSION) {
+    fprintf(stderr, "%s is not a trace file\n", argv[optind]);
+    return 1;
+  }
+
+  if (jfs_mount_with_options(disk, &options) < 0) {
+    perror("FATAL ERROR: failed to mount image");
+    return 1;
+  }
+
+  struct op_stats stats[JFS_NUM_OPS];
+  memset(stats, 0, sizeof(stats));
+  struct trace_record record;
+  char name[TRACE_NULL_NAME + 1];
+  uint64_t replay_start = now_ns();
+  int64_t offset_us = 0; // start of the current call, relative to the first one
+  int first = 1;
+  uint64_t truncated = 0; // calls skipped because a name was cut short
+  while (fread(&record, sizeof(record), 1, trace) == 1) {
+    size_t name_len = record.name_len == TRACE_NULL_NAME ? 0 : record.name_len;
+    if (fread(name, 1, name_len, trace) != name_len) {
+      fprintf(stderr, "trace is truncated\n");
+      break;
+    }
+    name[name_len] = '\0';
+    if (record.op == 0 || record.op >= JFS_NUM_OPS) {
+      fprintf(stderr, "skipping unknown op %d\n", record.op);
+      continue;
+    }
+
+    if (first) {
+      first = 0;
+    } else {
+      offset_us += record.start_delta_us;
+    }
+    if (record.flags & TRACE_TRUNCATED) {
+      truncated++;
+      continue;
+    }
+    if (original_timing) {
+      int64_t wait_ns = offset_us * 1000 - (int64_t) (now_ns() - replay_start);
+      if (wait_ns > 0) {
+        struct timespec ts = { wait_ns / 1000000000, wait_ns % 1000000000 };
+        nanosleep(&ts, NULL);
+      }
+    }
+
+    uint64_t start = now_ns();
+    int ret = replay_call(&record, record.name_len == TRACE_NULL_NAME ? NULL : name);
+    uint64_t elapsed = now_ns() - start;
+
+    struct op_stats* s = &stats[record.op];
+    s->count++;
+    s->errors += ret < 0;
+    s->total_ns += elapsed;
+    s->max_ns = elapsed > s->max_ns ? elapsed : s->max_ns;
+    s->recorded_us += record.duration_us;
+  }
+  uint64_t replay_elapsed = now_ns() - replay_start;
+  fclose(trace);
+
+  struct raw_stats disk_stats;
+  jfs_disk_stats(&disk_stats);
+  jfs_unmount();
+  print_report(stats, replay_elapsed);
+  printf("%llu block reads, %llu block writes, %llu syncs\n",
+         (unsigned long long) disk_stats.reads, (unsigned long long) disk_stats.writes,
+         (unsigned long long) disk_stats.syncs);
+  if (truncated > 0) {
+    printf("%" PRIu64 " calls skipped (names too long to record)\n", truncated);
+  }
+  return 0;
+}